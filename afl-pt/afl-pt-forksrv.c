@@ -0,0 +1,209 @@
+/*
+   afl-ptfuzz - fork server stub for binary-only targets
+   -----------------------------------------------------
+
+   afl-ptfuzz traces targets that were never compiled with afl-gcc, so they
+   carry no fork server of their own. With AFL_PT_FORKSRV=1 the fuzzer puts
+   this library in LD_PRELOAD instead. Its constructor runs once ld.so has
+   loaded and relocated everything (LD_BIND_NOW is set), but before control
+   reaches the program's entry point, and serves forks from there on
+   FORKSRV_FD and FORKSRV_FD + 1:
+
+     stub -> fuzzer    4 bytes hello
+     fuzzer -> stub    4 bytes, the previous run timed out
+     stub -> fuzzer    child pid
+     fuzzer -> child   4 bytes go
+     stub -> fuzzer    child status from waitpid()
+
+   Only the go message is new. A forked child does not exec, so the PT event
+   can not be armed with enable_on_exec; the child waits for go instead,
+   which afl-ptfuzz sends once the event for that pid is open and enabled.
+   The child then returns into ld.so and jumps to the entry point like an
+   exec'd target would, which is where the decoder starts.
+
+   Persistent mode (afl-ptfuzz -P, which sets AFL_PT_PERSISTENT_ADDR) goes
+   one step further for library-style targets. The stub takes over
+   __libc_start_main() and, once the target's constructors ran, calls the
+   function at that address in a loop instead of main():
+
+     int fn(const u8* buf, size_t len);
+
+   with the current input read from stdin, or from AFL_PT_PERSISTENT_FILE
+   if the target reads a file. After each call the child stops itself with
+   SIGSTOP; the status reports that, and the next request resumes it with
+   SIGCONT instead of forking - after the go message, so afl-ptfuzz can
+   enable the PT event first. AFL_PT_PERSISTENT_CNT iterations (default
+   PT_PERSIST_CNT) later the child exits and a fresh one is forked. The
+   target's main() never runs in this mode.
+
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include "types.h"
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Iterations of a persistent mode child before it is replaced. */
+
+#define PT_PERSIST_CNT      1000
+
+typedef int (*persistent_fn_t)(const u8* buf, size_t len);
+
+static persistent_fn_t persistent_fn;
+static u8* persistent_file;
+static u32 persistent_cnt = PT_PERSIST_CNT;
+
+
+/* Read the current input. The fuzzer rewrites it in place between
+   iterations, so always from the start. */
+
+static ssize_t read_input(u8* buf) {
+
+  ssize_t len;
+  s32 fd = 0;
+
+  if (persistent_file) {
+
+    fd = open(persistent_file, O_RDONLY);
+    if (fd < 0) return -1;
+
+  }
+
+  len = pread(fd, buf, MAX_FILE, 0);
+
+  if (persistent_file) close(fd);
+
+  return len;
+
+}
+
+
+/* Replaces main() in persistent mode. */
+
+static int persistent_main(int argc, char** argv, char** envp) {
+
+  u8* buf = malloc(MAX_FILE);
+  u32 i;
+
+  if (!buf) _exit(1);
+
+  for (i = 0; i < persistent_cnt; i++) {
+
+    ssize_t len = read_input(buf);
+    if (len < 0) _exit(1);
+
+    persistent_fn(buf, len);
+
+    if (i + 1 < persistent_cnt) raise(SIGSTOP);
+
+  }
+
+  return 0;
+
+}
+
+
+/* The program's _start calls this once ld.so and our constructor are done. */
+
+int __libc_start_main(int (*main)(int, char**, char**), int argc, char** argv,
+                      void (*init)(void), void (*fini)(void),
+                      void (*rtld_fini)(void), void* stack_end) {
+
+  int (*real_start_main)(int (*)(int, char**, char**), int, char**,
+                         void (*)(void), void (*)(void), void (*)(void),
+                         void*) = dlsym(RTLD_NEXT, "__libc_start_main");
+
+  if (persistent_fn) main = persistent_main;
+
+  return real_start_main(main, argc, argv, init, fini, rtld_fini, stack_end);
+
+}
+
+__attribute__((constructor)) static void afl_pt_forkserver(void) {
+
+  static u8 tmp[4];
+  u8* x;
+  u32 was_killed, msg;
+  s32 child_pid = 0;
+  u8 child_stopped = 0;
+  int status;
+
+  /* Whatever the target runs itself must not become a fork server too. */
+
+  unsetenv("LD_PRELOAD");
+
+  /* Not started by afl-ptfuzz: just run the program. */
+
+  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+
+  x = getenv("AFL_PT_PERSISTENT_ADDR");
+
+  if (x) {
+
+    persistent_fn  = (persistent_fn_t)strtoull(x, NULL, 0);
+    persistent_file = getenv("AFL_PT_PERSISTENT_FILE");
+
+    x = getenv("AFL_PT_PERSISTENT_CNT");
+    if (x && atoi(x) > 0) persistent_cnt = atoi(x);
+
+  }
+
+  while (1) {
+
+    if (read(FORKSRV_FD, &was_killed, 4) != 4) _exit(1);
+
+    /* The stopped child timed out and was killed by the fuzzer. */
+
+    if (child_stopped && was_killed) {
+
+      child_stopped = 0;
+      if (waitpid(child_pid, &status, 0) < 0) _exit(1);
+
+    }
+
+    if (!child_stopped) {
+
+      child_pid = fork();
+      if (child_pid < 0) _exit(1);
+
+      if (!child_pid) {
+
+        if (read(FORKSRV_FD, &msg, 4) != 4) _exit(1);
+
+        close(FORKSRV_FD);
+        close(FORKSRV_FD + 1);
+        return;
+
+      }
+
+      if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) _exit(1);
+
+    } else {
+
+      /* Next iteration of the persistent mode child. */
+
+      if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) _exit(1);
+      if (read(FORKSRV_FD, &msg, 4) != 4) _exit(1);
+
+      kill(child_pid, SIGCONT);
+      child_stopped = 0;
+
+    }
+
+    if (waitpid(child_pid, &status, persistent_fn ? WUNTRACED : 0) < 0)
+      _exit(1);
+
+    if (WIFSTOPPED(status)) child_stopped = 1;
+
+    if (write(FORKSRV_FD + 1, &status, 4) != 4) _exit(1);
+
+  }
+
+}
@@ -47,6 +47,7 @@
 #include <termios.h>
 #include <dlfcn.h>
 #include <sched.h>
+#include <elf.h>
 
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -101,8 +102,12 @@ EXP_ST u8 *in_dir,                    /* Input directory with test cases  */
           *in_bitmap,                 /* Input bitmap                     */
           *doc_path,                  /* Path to documentation dir        */
           *target_path,               /* Path to target binary            */
+          *pt_forksrv_path,           /* Fork server stub (LD_PRELOAD)    */
+          *pt_persist_arg,            /* -P function, address or symbol   */
           *orig_cmdline;              /* Original command line            */
 
+static u64 pt_persist_addr;           /* Function looped over with -P     */
+
 EXP_ST u32 exec_tmout = EXEC_TIMEOUT; /* Configurable exec timeout (ms)   */
 static u32 hang_tmout = EXEC_TIMEOUT; /* Timeout used for hang det (ms)   */
 
@@ -415,6 +420,32 @@ static void bind_to_free_cpu(void) {
   u8 cpu_used[4096] = { 0 };
   u32 i;
 
+  /* Parallel instances can be given their cores explicitly, e.g. to keep
+     each one's tracer pool on a core of its own. */
+
+  if (getenv("AFL_PT_CPU")) {
+
+    u8* end;
+
+    i = strtoul(getenv("AFL_PT_CPU"), (char**)&end, 10);
+
+    if (*end || end == (u8*)getenv("AFL_PT_CPU") || i >= cpu_core_count)
+      FATAL("Bad value of AFL_PT_CPU (must be below %u)", cpu_core_count);
+
+    OKF("Binding to CPU core #%u (AFL_PT_CPU).", i);
+
+    cpu_aff = i;
+
+    CPU_ZERO(&c);
+    CPU_SET(i, &c);
+
+    if (sched_setaffinity(0, sizeof(c), &c))
+      PFATAL("sched_setaffinity failed");
+
+    return;
+
+  }
+
   if (cpu_core_count < 2) return;
 
   if (getenv("AFL_NO_AFFINITY")) {
@@ -2081,6 +2112,27 @@ EXP_ST void init_forkserver(char** argv) {
 
     if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
 
+    /* Binary-only targets have no fork server of their own; preload the
+       stub that turns the process into one before it reaches main(). */
+
+    if (pt_forksrv_path) {
+
+      u8* preload = getenv("LD_PRELOAD");
+
+      if (preload)
+        setenv("LD_PRELOAD", alloc_printf("%s:%s", pt_forksrv_path, preload), 1);
+      else
+        setenv("LD_PRELOAD", pt_forksrv_path, 1);
+
+      if (pt_persist_addr) {
+
+        setenv("AFL_PT_PERSISTENT_ADDR", alloc_printf("0x%llx", pt_persist_addr), 1);
+        if (out_file) setenv("AFL_PT_PERSISTENT_FILE", out_file, 1);
+
+      }
+
+    }
+
     /* Set sane defaults for ASAN if nothing else specified. */
 
     setenv("ASAN_OPTIONS", "abort_on_error=1:"
@@ -2441,6 +2493,18 @@ static u8 run_target(char** argv, u32 timeout) {
 
     if (child_pid <= 0) FATAL("Fork server is misbehaving (OOM?)");
 
+    /* The child waits for the go message before it runs on, so the PT
+       event is enabled before the first instruction of the target. */
+
+    start_pt_fuzzer(child_pid);
+
+    if ((res = write(fsrv_ctl_fd, &child_pid, 4)) != 4) {
+
+      if (stop_soon) return 0;
+      RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+
+    }
+
   }
 
   /* Configure timeout, as requested by user, then wait for child to terminate. */
@@ -2470,6 +2534,12 @@ static u8 run_target(char** argv, u32 timeout) {
 
     }
 
+    /* A persistent mode child stops after each iteration and keeps its
+       PT event for the next one. */
+
+    if (WIFSTOPPED(status)) pause_pt_fuzzer(trace_bits);
+    else stop_pt_fuzzer(trace_bits);
+
   }
 
   if (!WIFSTOPPED(status)) child_pid = 0;
@@ -3464,6 +3534,12 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
   /* Keep last values in case we're called from another context
      where exec/sec stats and such are not readily available. */
 
+  pt_fuzzer_stats_t pt_stats;
+  double pt_execs;
+
+  get_pt_fuzzer_stats(&pt_stats);
+  pt_execs = pt_stats.execs ? pt_stats.execs : 1;
+
   if (!bitmap_cvg && !stability && !eps) {
     bitmap_cvg = last_bcvg;
     stability  = last_stab;
@@ -3501,6 +3577,18 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              "afl_banner        : %s\n"
              "afl_version       : " VERSION "\n"
              "target_mode       : %s%s%s%s%s%s%s\n"
+             "pt_tracer_pool    : %u\n"
+             "pt_ip_filter      : %u\n"
+             "pt_aux_size       : %llu\n"
+             "pt_overflows      : %llu\n"
+             "pt_snapshot       : %llu\n"
+             "pt_config         : 0x%llx\n"
+             "pt_psb_period     : %llu\n"
+             "pt_cofi_cached    : %u\n"
+             "pt_cofi_inst      : %llu\n"
+             "pt_tnt_dropped    : %llu\n"
+             "pt_setup_us       : %0.02f\n"
+             "pt_decode_us      : %0.02f\n"
              "command_line      : %s\n",
              start_time / 1000, get_cur_time() / 1000, getpid(),
              queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
@@ -3515,6 +3603,17 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
              (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
               persistent_mode || deferred_mode) ? "" : "default",
+             pt_stats.tracer_pool, pt_stats.filter_ranges,
+             (unsigned long long)pt_stats.aux_size,
+             (unsigned long long)pt_stats.overflows,
+             (unsigned long long)pt_stats.snapshot_size,
+             (unsigned long long)pt_stats.pt_config,
+             (unsigned long long)pt_stats.psb_period,
+             pt_stats.cofi_cached,
+             (unsigned long long)pt_stats.cofi_inst,
+             (unsigned long long)pt_stats.tnt_dropped,
+             pt_stats.setup_ns / pt_execs / 1000,
+             pt_stats.decode_ns / pt_execs / 1000,
              orig_cmdline);
              /* ignore errors */
 
@@ -3948,7 +4047,9 @@ static void show_stats(void) {
   u32 t_bytes, t_bits;
 
   u32 banner_len, banner_pad;
-  u8  tmp[256];
+  u8  tmp[256], pt_tmp[64];
+
+  pt_fuzzer_stats_t pt_stats;
 
   cur_ms = get_cur_time();
 
@@ -4355,6 +4456,19 @@ static void show_stats(void) {
 
   }
 
+  get_pt_fuzzer_stats(&pt_stats);
+
+  if (pt_stats.snapshot_size)
+    sprintf(pt_tmp, "last %s of %s ring", DMS(pt_stats.snapshot_size),
+            DMS(pt_stats.aux_size));
+  else
+    sprintf(pt_tmp, "%s aux ring%s", DMS(pt_stats.aux_size),
+            pt_stats.tracer_pool ? " (pooled)" : "");
+
+  SAYF(bV bSTOP "    pt trace : " cRST "%-37s " bSTG bV bSTOP " overflows : "
+       "%s%-10s " bSTG bV "\n", pt_tmp, pt_stats.overflows ? cLRD : cRST,
+       DI(pt_stats.overflows));
+
   SAYF(bV bSTOP "        trim : " cRST "%-37s " bSTG bVR bH20 bH2 bH2 bRB "\n"
        bLB bH30 bH20 bH2 bH bRB bSTOP cRST RESET_G1, tmp);
 
@@ -7103,7 +7217,7 @@ static void check_term_size(void) {
 
   if (ioctl(1, TIOCGWINSZ, &ws)) return;
 
-  if (ws.ws_row < 25 || ws.ws_col < 80) term_too_small = 1;
+  if (ws.ws_row < 26 || ws.ws_col < 80) term_too_small = 1;
 
 }
 
@@ -7125,7 +7239,8 @@ static void usage(u8* argv0) {
        "  -f file       - location read by the fuzzed program (stdin)\n"
        "  -t msec       - timeout for each run (auto-scaled, 50-%u ms)\n"
        "  -m megs       - memory limit for child process (%u MB)\n"
-       "  -Q            - use binary-only instrumentation (QEMU mode)\n\n"     
+       "  -Q            - use binary-only instrumentation (QEMU mode)\n"
+       "  -P fn         - persistent mode: loop over function fn (address or symbol)\n\n"     
  
        "Fuzzing behavior settings:\n\n"
 
@@ -7669,6 +7784,164 @@ EXP_ST void setup_signal_handlers(void) {
 }
 
 
+/* Whether [off, off + len) lies within a file of the given size. */
+
+static u8 in_file(u64 off, u64 len, u64 size) {
+
+  return off <= size && len <= size - off;
+
+}
+
+
+/* Resolve the -P argument: an address, or the name of a function in the
+   symbol table of the target. Every table and name is checked against the
+   file size before it is read, a truncated or odd ELF must not crash us. */
+
+static u64 find_persistent_addr(u8* fname, u8* arg) {
+
+  Elf64_Ehdr* ehdr;
+  Elf64_Shdr* shdr;
+  struct stat st;
+  u8 *f_data, *endptr;
+  u64 addr = strtoull(arg, (char**)&endptr, 0);
+  u64 arg_len = strlen(arg);
+  s32 fd, i;
+
+  if (!*endptr) return addr;
+
+  fd = open(fname, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st))
+    PFATAL("Unable to open '%s' to look up '%s' (try -P with an address)", fname, arg);
+
+  f_data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (f_data == MAP_FAILED) PFATAL("Unable to mmap file '%s'", fname);
+
+  close(fd);
+
+  ehdr = (Elf64_Ehdr*)f_data;
+
+  if (st.st_size < sizeof(Elf64_Ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64)
+    FATAL("'%s' is not a 64-bit ELF file, use -P with an address", fname);
+
+  /* PIE symbols are offsets, the load address is not known here. */
+
+  if (ehdr->e_type != ET_EXEC)
+    FATAL("'%s' is position independent, use -P with the run time address", fname);
+
+  if (ehdr->e_shnum && (ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+      !in_file(ehdr->e_shoff, (u64)ehdr->e_shnum * sizeof(Elf64_Shdr), st.st_size)))
+    FATAL("'%s' has a broken section header table, use -P with an address", fname);
+
+  shdr = (Elf64_Shdr*)(f_data + ehdr->e_shoff);
+  addr = 0;
+
+  for (i = 0; i < ehdr->e_shnum && !addr; i++) {
+
+    Elf64_Sym* sym;
+    Elf64_Shdr* str_shdr;
+    u8* strtab;
+    u64 j;
+
+    if (shdr[i].sh_type != SHT_SYMTAB && shdr[i].sh_type != SHT_DYNSYM) continue;
+
+    if (!in_file(shdr[i].sh_offset, shdr[i].sh_size, st.st_size) ||
+        shdr[i].sh_link >= ehdr->e_shnum) continue;
+
+    str_shdr = &shdr[shdr[i].sh_link];
+
+    if (!in_file(str_shdr->sh_offset, str_shdr->sh_size, st.st_size)) continue;
+
+    sym    = (Elf64_Sym*)(f_data + shdr[i].sh_offset);
+    strtab = f_data + str_shdr->sh_offset;
+
+    for (j = 0; j < shdr[i].sh_size / sizeof(Elf64_Sym); j++) {
+
+      /* The name and its terminator have to be inside the string table. */
+
+      if (ELF64_ST_TYPE(sym[j].st_info) == STT_FUNC && sym[j].st_value &&
+          sym[j].st_name < str_shdr->sh_size &&
+          str_shdr->sh_size - sym[j].st_name > arg_len &&
+          !memcmp(strtab + sym[j].st_name, arg, arg_len + 1)) {
+
+        addr = sym[j].st_value;
+        break;
+
+      }
+
+    }
+
+  }
+
+  munmap(f_data, st.st_size);
+
+  if (!addr) FATAL("Function '%s' not found in the symbol table of '%s'", arg, fname);
+
+  return addr;
+
+}
+
+
+/* Locate afl-pt-forksrv.so, the LD_PRELOAD stub that gives binary-only
+   targets a fork server. Same search order as afl-qemu-trace. */
+
+static void find_pt_forksrv(u8* own_loc) {
+
+  u8 *tmp, *cp, *rsl, *own_copy;
+
+  tmp = getenv("AFL_PATH");
+
+  if (tmp) {
+
+    cp = alloc_printf("%s/afl-pt-forksrv.so", tmp);
+
+    if (access(cp, R_OK))
+      FATAL("Unable to find '%s'", cp);
+
+    pt_forksrv_path = cp;
+    return;
+
+  }
+
+  own_copy = ck_strdup(own_loc);
+  rsl = strrchr(own_copy, '/');
+
+  if (rsl) {
+
+    *rsl = 0;
+
+    cp = alloc_printf("%s/afl-pt-forksrv.so", own_copy);
+    ck_free(own_copy);
+
+    if (!access(cp, R_OK)) {
+
+      pt_forksrv_path = cp;
+      return;
+
+    }
+
+    ck_free(cp);
+
+  } else ck_free(own_copy);
+
+  if (!access(AFL_PATH "/afl-pt-forksrv.so", R_OK)) {
+
+    pt_forksrv_path = ck_strdup(AFL_PATH "/afl-pt-forksrv.so");
+    return;
+
+  }
+
+  SAYF("\n" cLRD "[-] " cRST
+       "Oops, unable to find 'afl-pt-forksrv.so', which AFL_PT_FORKSRV needs. It\n"
+       "    is built next to afl-ptfuzz; if it is installed elsewhere, you may need\n"
+       "    to specify AFL_PATH in the environment, or unset AFL_PT_FORKSRV.\n");
+
+  FATAL("Failed to locate 'afl-pt-forksrv.so'.");
+
+}
+
+
 /* Rewrite argv for QEMU. */
 
 static char** get_qemu_argv(u8* own_loc, char** argv, int argc) {
@@ -7856,7 +8129,7 @@ int main(int argc, char** argv) {
   uint64_t min_addr = 0;
   uint64_t entry_point = 0;
 
-  while ((opt = getopt(argc, argv, "+i:o:f:m:t:T:dnCB:S:M:x:Q:r:l:h:e:")) > 0)
+  while ((opt = getopt(argc, argv, "+i:o:f:m:t:T:dnCB:S:M:x:Q:r:l:h:e:P:")) > 0)
 
     switch (opt) {
 
@@ -8044,6 +8317,10 @@ int main(int argc, char** argv) {
         printf("entry_point: %d\n", entry_point);
         break;
 
+      case 'P':
+        pt_persist_arg = optarg;
+        break;
+
       default:
 
         usage(argv[0]);
@@ -8067,7 +8344,31 @@ int main(int argc, char** argv) {
 
   }
 
-  if (!getenv("AFL_NO_FORKSRV"))    no_forkserver    = 1;
+  /* Before -P, which looks its function up in the binary found on PATH. */
+
+  check_binary(argv[optind]);
+
+  /* The target is not instrumented, so there is only a fork server when
+     AFL_PT_FORKSRV asks for the preloaded one. */
+
+  if ((!getenv("AFL_PT_FORKSRV") && !pt_persist_arg) || getenv("AFL_NO_FORKSRV"))
+    no_forkserver = 1;
+
+  if (pt_persist_arg) {
+
+    if (no_forkserver) FATAL("-P and AFL_NO_FORKSRV are mutually exclusive");
+    if (dumb_mode == 1) FATAL("-P and -n are mutually exclusive");
+
+    /* Decoding starts where each iteration starts. */
+
+    pt_persist_addr = find_persistent_addr(target_path, pt_persist_arg);
+    entry_point = pt_persist_addr;
+    persistent_mode = 1;
+
+    OKF(cPIN "Persistent mode, looping over the function at 0x%llx.", pt_persist_addr);
+
+  }
+
   if (getenv("AFL_NO_CPU_RED"))    no_cpu_meter_red = 1;
   if (getenv("AFL_NO_ARITH"))      no_arith         = 1;
   if (getenv("AFL_SHUFFLE_QUEUE")) shuffle_queue    = 1;
@@ -8106,6 +8407,7 @@ int main(int argc, char** argv) {
   //initial perf
   printf("init pt fuzzer.\n");
   init_pt_fuzzer(raw_bin, min_addr, max_addr, entry_point);
+  if (!no_forkserver && dumb_mode != 1) set_pt_fork_server(1);
 /*
   if(perf_init() == false)
   {
@@ -8154,6 +8456,7 @@ int main(int argc, char** argv) {
 
   setup_post();
   setup_shm();
+  set_pt_trace_bits(trace_bits);
   init_count_class16();
 
   setup_dirs_fds();
@@ -8170,7 +8473,9 @@ int main(int argc, char** argv) {
 
   if (!out_file) setup_stdio_file();
 
-  check_binary(argv[optind]);
+  if (!no_forkserver && dumb_mode != 1) find_pt_forksrv(argv[0]);
+
+  set_pt_target(target_path);
 
   start_time = get_cur_time();
 
@@ -8181,6 +8486,10 @@ int main(int argc, char** argv) {
 
   perform_dry_run(use_argv);
 
+  if (getenv("AFL_PT_AUX_SIZE") && !strcmp(getenv("AFL_PT_AUX_SIZE"), "auto"))
+    OKF("PT aux ring sized to %s for the traces seen in calibration.",
+        DMS(tune_pt_aux_size()));
+
   cull_queue();
 
   show_init_stats();
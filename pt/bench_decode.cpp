@@ -0,0 +1,121 @@
+#include "pt.h"
+#include <iostream>
+#include <vector>
+
+/* Decode a recorded PT trace over and over and report how fast the packet
+   decoder is. No PT hardware needed, only the .text dump of the traced binary
+   and the raw aux buffer bytes. It is timed twice: with a new decoder for
+   every decode, and with one decoder that is reset() into a bitmap of ours,
+   the way pt_fuzzer uses it. Heap allocations are counted for both. */
+
+static uint64_t num_allocs = 0;
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t nmemb, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size)
+{
+    num_allocs ++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    num_allocs ++;
+    return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    num_allocs ++;
+    return __libc_realloc(ptr, size);
+}
+}
+
+static bool read_file(const char* path, std::vector<uint8_t>& buf)
+{
+    FILE* fp = fopen(path, "rb");
+    if(fp == nullptr) {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf.resize(size);
+    size_t count = fread(buf.data(), 1, size, fp);
+    fclose(fp);
+    return count == (size_t)size;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 6) {
+        std::cout << argv[0] << " <raw_bin> <min_addr> <max_addr> <entry_point> <trace> [iterations]" << std::endl;
+        exit(0);
+    }
+    char* raw_bin = argv[1];
+    uint64_t min_addr = strtoul(argv[2], nullptr, 0);
+    uint64_t max_addr = strtoul(argv[3], nullptr, 0);
+    uint64_t entry_point = strtoul(argv[4], nullptr, 0);
+    char* trace_file = argv[5];
+    uint32_t iterations = argc > 6 ? strtoul(argv[6], nullptr, 0) : 100;
+
+    std::vector<uint8_t> code;
+    if(!read_file(raw_bin, code) || code.size() < max_addr - min_addr) {
+        std::cerr << "read raw binary failed." << std::endl;
+        exit(-1);
+    }
+    std::vector<uint8_t> trace;
+    if(!read_file(trace_file, trace) || trace.empty()) {
+        std::cerr << "read trace failed." << std::endl;
+        exit(-1);
+    }
+
+    cofi_map_t cofi_map;
+    uint32_t num_cofi_inst = disassemble_binary(code.data(), min_addr, max_addr, cofi_map);
+    std::cout << "number of cofi inst: " << num_cofi_inst << std::endl;
+
+    uint64_t num_decoded_branch = 0;
+    std::vector<uint8_t> fresh_bits(MAP_SIZE);
+    std::chrono::duration<double> total(0);
+    uint64_t allocs = num_allocs;
+    for(uint32_t i = 0; i < iterations; i ++) {
+        auto start = std::chrono::steady_clock::now();
+        pt_packet_decoder decoder(trace.data(), trace.size(), cofi_map, min_addr, max_addr, entry_point);
+        decoder.decode();
+        memcpy(fresh_bits.data(), decoder.get_trace_bits(), MAP_SIZE);
+        total += std::chrono::steady_clock::now() - start;
+        num_decoded_branch = decoder.num_decoded_branch;
+    }
+    double fresh_allocs = (double)(num_allocs - allocs) / iterations;
+
+    double per_decode = total.count() / iterations;
+    std::cout << "trace size: " << trace.size() << " bytes, decoded branches: " << num_decoded_branch << std::endl;
+    std::cout << "time of decode: " << per_decode * 1000000000 << " ns, "
+              << trace.size() / per_decode / (1024 * 1024) << " MB/s, " << fresh_allocs << " allocations/decode" << std::endl;
+
+    //the bitmap is cleared by its owner before each run, as AFL does with trace_bits.
+    std::vector<uint8_t> bits(MAP_SIZE);
+    pt_packet_decoder decoder(cofi_map, min_addr, max_addr, entry_point);
+    total = std::chrono::duration<double>(0);
+    allocs = num_allocs;
+    for(uint32_t i = 0; i < iterations; i ++) {
+        memset(bits.data(), 0, MAP_SIZE);
+        auto start = std::chrono::steady_clock::now();
+        decoder.reset(trace.data(), trace.size(), bits.data());
+        decoder.decode();
+        total += std::chrono::steady_clock::now() - start;
+    }
+    double reused_allocs = (double)(num_allocs - allocs) / iterations;
+
+    double per_reused = total.count() / iterations;
+    std::cout << "reused decoder: " << per_reused * 1000000000 << " ns, "
+              << trace.size() / per_reused / (1024 * 1024) << " MB/s, " << reused_allocs << " allocations/decode" << std::endl;
+    if(decoder.num_decoded_branch != num_decoded_branch || memcmp(bits.data(), fresh_bits.data(), MAP_SIZE) != 0) {
+        std::cerr << "the reused decoder does not agree with a fresh one." << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "pt.h"
+#include <iostream>
+#include <thread>
+#include <vector>
+
+/* Time disassemble_binary() on the .text dump of a binary with 1, 2, 4, ...
+   threads and report instructions per second. Every map has to be the same
+   as the one a single thread builds. */
+
+static bool read_file(const char* path, std::vector<uint8_t>& buf)
+{
+    FILE* fp = fopen(path, "rb");
+    if(fp == nullptr) {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf.resize(size);
+    size_t count = fread(buf.data(), 1, size, fp);
+    fclose(fp);
+    return count == (size_t)size;
+}
+
+static bool same_map(const cofi_map_t& a, const cofi_map_t& b, uint64_t min_addr, uint64_t max_addr)
+{
+    if(a.size() != b.size() || a.num_blocks() != b.num_blocks()) {
+        return false;
+    }
+    for(uint32_t i = 0; i < a.size(); i ++) {
+        const cofi_inst_t* x = a.get_record(i);
+        const cofi_inst_t* y = b.get_record(i);
+        if(x->inst_addr != y->inst_addr || x->type != y->type || x->target_addr != y->target_addr || x->inst_size != y->inst_size) {
+            return false;
+        }
+    }
+    for(uint64_t addr = min_addr; addr < max_addr; addr ++) {
+        const cofi_inst_t* x = a[addr];
+        const cofi_inst_t* y = b[addr];
+        if((x == nullptr) != (y == nullptr) || (x && x - a.begin() != y - b.begin())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 4) {
+        std::cout << argv[0] << " <raw_bin> <min_addr> <max_addr> [max_threads] [iterations]" << std::endl;
+        exit(0);
+    }
+    char* raw_bin = argv[1];
+    uint64_t min_addr = strtoul(argv[2], nullptr, 0);
+    uint64_t max_addr = strtoul(argv[3], nullptr, 0);
+    uint32_t max_threads = argc > 4 ? strtoul(argv[4], nullptr, 0) : std::thread::hardware_concurrency();
+    uint32_t iterations = argc > 5 ? strtoul(argv[5], nullptr, 0) : 5;
+    if(max_threads == 0) {
+        max_threads = 1;
+    }
+
+    std::vector<uint8_t> code;
+    if(!read_file(raw_bin, code) || code.size() < max_addr - min_addr) {
+        std::cerr << "read raw binary failed." << std::endl;
+        exit(-1);
+    }
+
+    cofi_map_t reference;
+    disassemble_binary(code.data(), min_addr, max_addr, reference);
+    uint64_t num_inst = 0;
+    for(uint64_t addr = min_addr; addr < max_addr; addr ++) {
+        num_inst += reference[addr] != nullptr;
+    }
+    std::cout << "code size: " << max_addr - min_addr << " bytes, instructions: " << num_inst << ", cofi inst: " << reference.size() - 1
+              << ", basic blocks: " << reference.num_blocks() << std::endl;
+
+    double single = 0;
+    for(uint32_t threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+        cofi_map_t cofi_map;
+        std::chrono::duration<double> total(0);
+        for(uint32_t i = 0; i < iterations; i ++) {
+            auto start = std::chrono::steady_clock::now();
+            disassemble_binary(code.data(), min_addr, max_addr, cofi_map, threads);
+            total += std::chrono::steady_clock::now() - start;
+        }
+        if(!same_map(cofi_map, reference, min_addr, max_addr)) {
+            std::cerr << threads << " threads built a different map." << std::endl;
+            return 1;
+        }
+        double per_run = total.count() / iterations;
+        if(threads == 1) {
+            single = per_run;
+        }
+        std::cout << threads << " threads: " << per_run * 1000 << " ms, " << num_inst / per_run / 1000000 << " M inst/s, "
+                  << (max_addr - min_addr) / per_run / (1024 * 1024) << " MB/s, speedup " << single / per_run << std::endl;
+        if(threads == max_threads) {
+            break;
+        }
+    }
+    return 0;
+}
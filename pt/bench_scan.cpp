@@ -0,0 +1,120 @@
+#include "pt.h"
+#include "pt_scan.h"
+#include <iostream>
+#include <vector>
+
+/* Time the PSB and PAD scans of every implementation this cpu supports on
+   recorded traces (AFL_PT_CAPTURE_DIR or pt_gen format):
+     psb     find every PSB in the trace, what an out of sync decoder does
+     pad     step over the trace's PAD bytes the way the decoder does
+     zeros   skip a zero filled buffer of the same size, a mostly empty ring
+   All implementations have to agree on what they find. */
+
+typedef struct {
+	uint64_t found;
+	double seconds;
+} scan_result_t;
+
+static scan_result_t time_psb(const pt_scan_impl_t* impl, uint8_t* data, uint64_t size, uint32_t iterations)
+{
+	scan_result_t result = {0, 0};
+	auto start = std::chrono::steady_clock::now();
+	for(uint32_t n = 0; n < iterations; n ++) {
+		uint64_t found = 0;
+		uint8_t* end = data + size;
+		for(uint8_t* p = impl->find_psb(data, end); p != nullptr; p = impl->find_psb(p + PT_PKT_PSB_LEN, end)) {
+			found ++;
+		}
+		result.found = found;
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / iterations;
+	return result;
+}
+
+static scan_result_t time_pad(const pt_scan_impl_t* impl, uint8_t* data, uint64_t size, uint32_t iterations)
+{
+	scan_result_t result = {0, 0};
+	auto start = std::chrono::steady_clock::now();
+	for(uint32_t n = 0; n < iterations; n ++) {
+		//same as the PAD case of pt_packet_decoder::decode_packets(), other bytes count as one byte packets.
+		uint64_t found = 0;
+		uint8_t* end = data + size;
+		for(uint8_t* p = data; p < end; ) {
+			if(*p == 0) {
+				p ++;
+				if(p < end && *p == 0) {
+					p = impl->skip_pad(p, end);
+				}
+				found ++;
+			}
+			else {
+				p ++;
+			}
+		}
+		result.found = found;
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / iterations;
+	return result;
+}
+
+static void report(const char* what, const pt_scan_impl_t* impl, scan_result_t& result, uint64_t size, double baseline)
+{
+	std::cout << "  " << what << "\t" << impl->name << "\t" << result.found << " found, "
+	          << size / result.seconds / (1024 * 1024) << " MB/s, x" << baseline / result.seconds << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t iterations = 20;
+	int opt;
+	while((opt = getopt(argc, argv, "n:")) > 0) {
+		switch(opt) {
+		case 'n':
+			iterations = strtoul(optarg, nullptr, 0);
+			break;
+		default:
+			std::cout << argv[0] << " [-n iterations] <trace.pt> [trace.pt ...]" << std::endl;
+			exit(0);
+		}
+	}
+	if(argc - optind < 1 || iterations == 0) {
+		std::cout << argv[0] << " [-n iterations] <trace.pt> [trace.pt ...]" << std::endl;
+		exit(0);
+	}
+
+	std::vector<const pt_scan_impl_t*> impls = pt_scan_available();
+	//the scalar version is last, compare against it.
+	std::reverse(impls.begin(), impls.end());
+	bool ok = true;
+	for(int i = optind; i < argc; i ++) {
+		pt_trace_header_t header;
+		uint8_t* trace = pt_trace_read(argv[i], &header);
+		if(trace == nullptr) {
+			exit(-1);
+		}
+		uint64_t size = header.trace_size;
+		std::vector<uint8_t> zeros(size, 0);
+		std::cout << argv[i] << ": " << size << " bytes" << std::endl;
+
+		scan_result_t psb_base = {}, pad_base = {}, zero_base = {};
+		for(size_t k = 0; k < impls.size(); k ++) {
+			scan_result_t psb = time_psb(impls[k], trace, size, iterations);
+			scan_result_t pad = time_pad(impls[k], trace, size, iterations);
+			scan_result_t zero = time_pad(impls[k], zeros.data(), size, iterations);
+			if(k == 0) {
+				psb_base = psb;
+				pad_base = pad;
+				zero_base = zero;
+			}
+			else if(psb.found != psb_base.found || pad.found != pad_base.found || zero.found != zero_base.found) {
+				std::cerr << impls[k]->name << " does not agree with " << impls[0]->name << "." << std::endl;
+				ok = false;
+			}
+			report("psb", impls[k], psb, size, psb_base.seconds);
+			report("pad", impls[k], pad, size, pad_base.seconds);
+			report("zeros", impls[k], zero, size, zero_base.seconds);
+		}
+		free(trace);
+	}
+	return ok ? 0 : 1;
+}
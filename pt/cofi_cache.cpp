@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include "cofi_cache.h"
+
+#define COFI_CACHE_ALIGN	8
+
+static uint64_t align_up(uint64_t offset) {
+	return (offset + COFI_CACHE_ALIGN - 1) & ~(uint64_t)(COFI_CACHE_ALIGN - 1);
+}
+
+//64 bit words at a time, the tail and the range are mixed in at the end.
+uint64_t cofi_cache_key(const uint8_t* code, uint64_t base_address, uint64_t code_size) {
+	const uint64_t prime = 0x100000001b3ULL;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint64_t i = 0;
+	for(; i + 8 <= code_size; i += 8) {
+		uint64_t word;
+		memcpy(&word, code + i, 8);
+		hash = (hash ^ word) * prime;
+		hash ^= hash >> 29;
+	}
+	for(; i < code_size; i ++) {
+		hash = (hash ^ code[i]) * prime;
+	}
+	hash = (hash ^ base_address) * prime;
+	hash = (hash ^ code_size) * prime;
+	return hash ^ (hash >> 32);
+}
+
+/* The header only says where the tables are. The decoder follows the numbers
+   in them without checks, so a damaged file has to fail here: every record
+   number, block number and edge range has to point into its table, and the
+   walk needs the end record behind the last cofi. */
+static bool check_tables(const cofi_cache_header_t* header, const uint8_t* base) {
+	const uint32_t* index = (const uint32_t*)(base + header->index_offset);
+	const cofi_inst_t* records = (const cofi_inst_t*)(base + header->record_offset);
+	const cofi_block_t* blocks = (const cofi_block_t*)(base + header->block_offset);
+	const uint32_t* successors = (const uint32_t*)(base + header->successor_offset);
+	for(uint64_t i = 0; i < header->code_size; i ++) {
+		if(index[i] > header->record_count) {
+			return false;
+		}
+	}
+	for(uint32_t i = 0; i < header->record_count; i ++) {
+		if((uint32_t)records[i].type > NO_COFI_TYPE) {
+			return false;
+		}
+	}
+	if(records[header->record_count - 1].type != NO_COFI_TYPE) {
+		return false;
+	}
+	for(uint32_t i = 0; i < header->block_count; i ++) {
+		const cofi_block_t& block = blocks[i];
+		if(block.entry >= header->record_count || block.cofi >= header->record_count ||
+				block.taken > header->block_count || block.fall > header->block_count ||
+				(uint64_t)block.edge_offset + block.num_jumps > header->edge_count) {
+			return false;
+		}
+	}
+	for(uint64_t i = 0; i < (uint64_t)header->record_count * 2; i ++) {
+		if(successors[i] > header->block_count) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool cofi_map_t::load(const char* path, uint64_t key, uint64_t base_address, uint64_t code_size) {
+	clear();
+#ifdef DEBUG_COFI_INST
+	//the records hold strings.
+	return false;
+#endif
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(cofi_cache_header_t)) {
+		close(fd);
+		return false;
+	}
+	void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		return false;
+	}
+	const cofi_cache_header_t* header = (const cofi_cache_header_t*)map;
+	const uint8_t* base = (const uint8_t*)map;
+	uint64_t size = st.st_size;
+	bool ok = header->magic == COFI_CACHE_MAGIC && header->version == COFI_CACHE_VERSION &&
+			header->header_size == sizeof(cofi_cache_header_t) && header->file_size == size &&
+			header->record_size == sizeof(cofi_inst_t) && header->block_size == sizeof(cofi_block_t) &&
+			header->key == key && header->base_address == base_address && header->code_size == code_size &&
+			header->record_count > 0;
+	//every table has to be inside the file.
+	ok = ok && header->index_offset <= size && code_size * sizeof(uint32_t) <= size - header->index_offset &&
+			header->record_offset <= size && (uint64_t)header->record_count * sizeof(cofi_inst_t) <= size - header->record_offset &&
+			header->block_offset <= size && (uint64_t)header->block_count * sizeof(cofi_block_t) <= size - header->block_offset &&
+			header->edge_offset <= size && (uint64_t)header->edge_count * sizeof(uint16_t) <= size - header->edge_offset &&
+			header->successor_offset <= size && (uint64_t)header->record_count * 2 * sizeof(uint32_t) <= size - header->successor_offset;
+	ok = ok && check_tables(header, base);
+	if(!ok) {
+		munmap(map, size);
+		return false;
+	}
+	this->mapping = map;
+	this->mapping_size = size;
+	this->base_address = base_address;
+	this->code_size = code_size;
+	this->index = (const uint32_t*)(base + header->index_offset);
+	this->records = (const cofi_inst_t*)(base + header->record_offset);
+	this->blocks = (const cofi_block_t*)(base + header->block_offset);
+	this->block_edges = (const uint16_t*)(base + header->edge_offset);
+	this->successors = (const uint32_t*)(base + header->successor_offset);
+	this->record_count = header->record_count;
+	this->block_count = header->block_count;
+	this->edge_count = header->edge_count;
+	return true;
+}
+
+static bool write_table(FILE* fp, uint64_t offset, const void* data, uint64_t size) {
+	if(fseek(fp, offset, SEEK_SET) != 0) {
+		return false;
+	}
+	return size == 0 || fwrite(data, size, 1, fp) == 1;
+}
+
+bool cofi_map_t::save(const char* path, uint64_t key) const {
+#ifdef DEBUG_COFI_INST
+	return false;
+#endif
+	//only holds what was reached so far.
+	if(this->lazy != nullptr) {
+		return false;
+	}
+	cofi_cache_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.magic = COFI_CACHE_MAGIC;
+	header.version = COFI_CACHE_VERSION;
+	header.header_size = sizeof(cofi_cache_header_t);
+	header.record_size = sizeof(cofi_inst_t);
+	header.block_size = sizeof(cofi_block_t);
+	header.key = key;
+	header.base_address = this->base_address;
+	header.code_size = this->code_size;
+	header.record_count = this->record_count;
+	header.block_count = this->block_count;
+	header.edge_count = this->edge_count;
+	header.index_offset = align_up(sizeof(header));
+	header.record_offset = align_up(header.index_offset + this->code_size * sizeof(uint32_t));
+	header.block_offset = align_up(header.record_offset + (uint64_t)this->record_count * sizeof(cofi_inst_t));
+	header.edge_offset = align_up(header.block_offset + (uint64_t)this->block_count * sizeof(cofi_block_t));
+	header.successor_offset = align_up(header.edge_offset + (uint64_t)this->edge_count * sizeof(uint16_t));
+	header.file_size = header.successor_offset + (uint64_t)this->record_count * 2 * sizeof(uint32_t);
+
+	//other instances may be mapping the file, replace it in one go.
+	std::string tmp_path = std::string(path) + ".tmp." + std::to_string(getpid());
+	FILE* fp = fopen(tmp_path.c_str(), "wb");
+	if(fp == nullptr) {
+		std::cerr << "open cofi cache " << tmp_path << " for writing failed." << std::endl;
+		return false;
+	}
+	bool ok = write_table(fp, 0, &header, sizeof(header)) &&
+			write_table(fp, header.index_offset, this->index, this->code_size * sizeof(uint32_t)) &&
+			write_table(fp, header.record_offset, this->records, (uint64_t)this->record_count * sizeof(cofi_inst_t)) &&
+			write_table(fp, header.block_offset, this->blocks, (uint64_t)this->block_count * sizeof(cofi_block_t)) &&
+			write_table(fp, header.edge_offset, this->block_edges, (uint64_t)this->edge_count * sizeof(uint16_t)) &&
+			write_table(fp, header.successor_offset, this->successors, (uint64_t)this->record_count * 2 * sizeof(uint32_t));
+	ok = fclose(fp) == 0 && ok;
+	if(!ok || rename(tmp_path.c_str(), path) != 0) {
+		std::cerr << "write cofi cache " << path << " failed." << std::endl;
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+uint32_t disassemble_binary_cached(const uint8_t* code, uint64_t base_address, uint64_t max_address, cofi_map_t& cofi_map, const char* cache_dir,
+		uint32_t num_threads) {
+	uint64_t code_size = max_address - base_address;
+	uint64_t key = cofi_cache_key(code, base_address, code_size);
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/cofi_%016" PRIx64 ".map", cache_dir, key);
+	if(cofi_map.load(path, key, base_address, code_size)) {
+#ifdef DEBUG
+		std::cout << "cofi map loaded from " << path << std::endl;
+#endif
+		//without the end record.
+		return cofi_map.size() - 1;
+	}
+	uint32_t num_inst = disassemble_binary(code, base_address, max_address, cofi_map, num_threads);
+	if(cofi_map.size() > 0) {
+		cofi_map.save(path, key);
+	}
+	return num_inst;
+}
@@ -0,0 +1,46 @@
+#ifndef _COFI_CACHE_H_
+#define _COFI_CACHE_H_
+
+#include <stdint.h>
+#include "disassembler.h"
+
+/* On-disk copy of a cofi map, so that a fuzzer started again on the same
+   binary does not disassemble it again. The file is a fixed header followed
+   by the map's tables as they are in memory, each 8 byte aligned, and is
+   mapped back read-only and shared: all instances on a host that fuzz the
+   same code use the same pages. Files are named after a hash of the code
+   bytes and the load address, a binary that changes gets a new file. */
+
+#define COFI_CACHE_MAGIC	0x0050414d49464f43ULL	/* "COFIMAP\0" */
+//bump when cofi_inst_t, cofi_block_t or how the tables are built changes.
+#define COFI_CACHE_VERSION	1
+
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;			//sizeof(cofi_inst_t) and sizeof(cofi_block_t) of the writer
+	uint32_t block_size;
+	uint64_t key;
+	uint64_t base_address;
+	uint64_t code_size;
+	uint32_t record_count;
+	uint32_t block_count;
+	uint32_t edge_count;
+	uint32_t reserved;
+	//file offsets of the tables.
+	uint64_t index_offset;
+	uint64_t record_offset;
+	uint64_t block_offset;
+	uint64_t edge_offset;
+	uint64_t successor_offset;
+	uint64_t file_size;
+} cofi_cache_header_t;
+
+//hash of the code bytes and where they are loaded.
+uint64_t cofi_cache_key(const uint8_t* code, uint64_t base_address, uint64_t code_size);
+//disassemble_binary(), but map <cache_dir>/cofi_<key>.map if it is there and write it if not.
+uint32_t disassemble_binary_cached(const uint8_t* code, uint64_t base_address, uint64_t max_address, cofi_map_t& cofi_map, const char* cache_dir,
+		uint32_t num_threads = 1);
+
+#endif
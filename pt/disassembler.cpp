@@ -18,8 +18,11 @@ You should have received a copy of the GNU General Public License
 along with QEMU-PT.  If not, see <http://www.gnu.org/licenses/>.
 
 */
-#include <map>
 #include "disassembler.h"
+#include <sys/mman.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
 
 #define LOOKUP_TABLES		5
 #define IGN_MOD_RM			0
@@ -526,66 +529,477 @@ static cofi_type get_inst_type(cs_insn *ins){
 
 
 
-uint32_t disassemble_binary(const uint8_t* code, uint64_t base_address, uint64_t max_address, cofi_map_t& cofi_map){
-	csh handle;
-	cs_insn *insn;
-	cofi_type type;
-	uint64_t num_inst = 0;
-	uint64_t num_cofi_inst = 0;
+//chunks smaller than this are not worth a thread.
+#define DISASM_MIN_CHUNK	(64 * 1024)
+//how far behind the even split a chunk may start, to begin behind padding.
+#define DISASM_PAD_SCAN		4096
+
+/* A piece of the code, swept on its own thread like the whole code is swept
+   by a single one. Its instructions are numbered from 1 in the shared index,
+   merge_chunks() renumbers them once it is known how many records come
+   before. */
+typedef struct {
+	uint64_t start;					//where the sweep starts
+	uint64_t end;					//it decodes the instructions starting before end, the last one may reach past it
+	uint64_t stop;					//behind the last decoded instruction
+	bool invalid;					//the sweep stopped at bytes that are no instruction
+	std::vector<cofi_inst_t> records;
+	//after a fix-up: index entries before sync count from the new first record, the others are shift off.
+	uint64_t sync;
+	int64_t shift;
+} disasm_chunk_t;
+
+static void make_cofi(cs_insn* insn, cofi_type type, cofi_inst_t* cofi){
+	cofi->inst_addr = insn->address;
+	cofi->type = type;
+	cofi->inst_size = insn->size;
+	cofi->is_call = insn->id == X86_INS_CALL && type != COFI_TYPE_FAR_TRANSFERS;
+	if (type == COFI_TYPE_CONDITIONAL_BRANCH || type == COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH){
+		cofi->target_addr = hex_to_bin(insn->op_str);
+	}
+	else {
+		cofi->target_addr = 0;
+#ifdef DEBUG
+		printf("%lx:\t(%d)\t%s\t%s\t\t\n", insn->address, type, insn->mnemonic, insn->op_str);
+#endif
+	}
+}
 
-	size_t code_size = max_address - base_address;
-	uint64_t address = base_address;
+//decode the instruction at address, false if there is none.
+static bool decode_at(csh handle, cs_insn* insn, const uint8_t* code, uint64_t base_address, uint64_t max_address, uint64_t address){
+	const uint8_t* p = code + (address - base_address);
+	size_t size = max_address - address;
+	return address < max_address && cs_disasm_iter(handle, &p, &size, &address, insn);
+}
 
+static void sweep_chunk(const uint8_t* code, uint64_t base_address, uint64_t max_address, disasm_chunk_t* chunk, uint32_t* index){
+	csh handle;
+	chunk->stop = chunk->start;
+	chunk->invalid = true;
 	if (cs_open(CS_ARCH_X86, CS_MODE_64, &handle) != CS_ERR_OK)
-		return false;
-
+		return;
 	cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
-	insn = cs_malloc(handle);
+	cs_insn* insn = cs_malloc(handle);
+
+	const uint8_t* p = code + (chunk->start - base_address);
+	size_t size = max_address - chunk->start;
+	uint64_t address = chunk->start;
+	chunk->invalid = false;
+	while(address < chunk->end) {
+		if(!cs_disasm_iter(handle, &p, &size, &address, insn)) {
+			//the serial sweep ends there, and so does the code.
+			chunk->invalid = size > 0;
+			break;
+		}
+		cofi_type type = get_inst_type(insn);
+		//every instruction points at the record of the next cofi, which is appended below or later.
+		index[insn->address - base_address] = chunk->records.size() + 1;
+		if (type != NO_COFI_TYPE){
+			chunk->records.push_back(cofi_inst_t());
+			make_cofi(insn, type, &chunk->records.back());
+		}
+		chunk->stop = address;
+	}
+	cs_free(insn, 1);
+	cs_close(&handle);
+}
 
-	cofi_inst_t* current_cofi = nullptr;
-	cofi_inst_t* pre_cofi = nullptr;
+/* The previous chunk's last instruction ends at from, inside this chunk: its
+   sweep started in the middle of an instruction or on data. Sweep again from
+   there until an instruction boundary of the chunk comes up, on x86 that is
+   usually after a few instructions, and keep the chunk from that point on. */
+static void fix_up_chunk(csh handle, cs_insn* insn, const uint8_t* code, uint64_t base_address, uint64_t max_address,
+		disasm_chunk_t* chunk, uint32_t* index, uint64_t from){
+	std::vector<cofi_inst_t> prefix;
+	std::vector<std::pair<uint64_t, uint32_t>> entries;
+	uint64_t address = from;
+	bool invalid = false;
+	while(address < chunk->end && index[address - base_address] == 0) {
+		if(!decode_at(handle, insn, code, base_address, max_address, address)) {
+			invalid = address < max_address;
+			break;
+		}
+		cofi_type type = get_inst_type(insn);
+		entries.push_back(std::make_pair(address - base_address, (uint32_t)prefix.size() + 1));
+		if (type != NO_COFI_TYPE){
+			prefix.push_back(cofi_inst_t());
+			make_cofi(insn, type, &prefix.back());
+		}
+		address += insn->size;
+	}
 
-	while(cs_disasm_iter(handle, &code, &code_size, &address, insn)) {
-		if (insn->address > max_address){
+	//the chunk's own instructions before the sync point are none, after it they stay.
+	uint64_t sync = address < chunk->end && !invalid ? address : chunk->end;
+	memset(index + (chunk->start - base_address), 0, (sync - chunk->start) * sizeof(uint32_t));
+	size_t dropped = 0;
+	while(dropped < chunk->records.size() && chunk->records[dropped].inst_addr < sync) {
+		dropped ++;
+	}
+	if(invalid) {
+		memset(index + (sync - base_address), 0, (chunk->end - sync) * sizeof(uint32_t));
+		dropped = chunk->records.size();
+		chunk->stop = address;
+		chunk->invalid = true;
+	}
+	else if(sync == chunk->end) {
+		chunk->stop = address;
+	}
+	for(auto& entry : entries) {
+		index[entry.first] = entry.second;
+	}
+	chunk->shift = (int64_t)prefix.size() - dropped;
+	chunk->records.erase(chunk->records.begin(), chunk->records.begin() + dropped);
+	chunk->records.insert(chunk->records.begin(), prefix.begin(), prefix.end());
+	chunk->start = from;
+	chunk->sync = sync;
+}
+
+//start a chunk behind a run of int3 or nop padding near offset, which is most likely the entry of a function.
+static uint64_t chunk_start(const uint8_t* code, uint64_t code_size, uint64_t offset){
+	uint64_t limit = std::min(offset + DISASM_PAD_SCAN, code_size);
+	for(uint64_t i = offset; i + 2 < limit; i ++) {
+		if((code[i] != 0xcc && code[i] != 0x90) || code[i + 1] != code[i]) {
+			continue;
+		}
+		uint64_t j = i + 2;
+		while(j < limit && code[j] == code[i]) {
+			j ++;
+		}
+		if(j < limit) {
+			return j;
+		}
+	}
+	return offset;
+}
+
+template<typename F> static void run_chunks(uint32_t num_chunks, F fn){
+	std::vector<std::thread> threads;
+	for(uint32_t i = 1; i < num_chunks; i ++) {
+		threads.push_back(std::thread(fn, i));
+	}
+	fn(0);
+	for(auto& thread : threads) {
+		thread.join();
+	}
+}
+
+/* Make the chunks one sweep: fix up every chunk that the previous one reaches
+   into, drop everything behind an invalid instruction, then number the index
+   entries of each chunk from the records before it. */
+static void merge_chunks(const uint8_t* code, uint64_t base_address, uint64_t max_address, std::vector<disasm_chunk_t>& chunks, uint32_t* index){
+	csh handle;
+	cs_insn* insn = nullptr;
+	if (cs_open(CS_ARCH_X86, CS_MODE_64, &handle) == CS_ERR_OK){
+		cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
+		insn = cs_malloc(handle);
+	}
+	uint32_t num_chunks = 1;
+	for(; num_chunks < chunks.size(); num_chunks ++) {
+		disasm_chunk_t& prev = chunks[num_chunks - 1];
+		disasm_chunk_t& chunk = chunks[num_chunks];
+		if(prev.invalid) {
 			break;
 		}
+		if(prev.stop != chunk.start) {
+			if(insn == nullptr) {
+				break;
+			}
+			fix_up_chunk(handle, insn, code, base_address, max_address, &chunk, index, prev.stop);
+		}
+	}
+	if(insn != nullptr) {
+		cs_free(insn, 1);
+		cs_close(&handle);
+	}
+	for(uint32_t i = num_chunks; i < chunks.size(); i ++) {
+		memset(index + (chunks[i].start - base_address), 0, (chunks[i].end - chunks[i].start) * sizeof(uint32_t));
+	}
+	chunks.resize(num_chunks);
 
-		type = get_inst_type(insn);
-		num_inst ++;
+	std::vector<uint32_t> first_record(num_chunks, 0);
+	for(uint32_t i = 1; i < num_chunks; i ++) {
+		first_record[i] = first_record[i - 1] + chunks[i - 1].records.size();
+	}
+	run_chunks(num_chunks, [&](uint32_t i) {
+		disasm_chunk_t& chunk = chunks[i];
+		for(uint64_t offset = chunk.start - base_address; offset < chunk.end - base_address; offset ++) {
+			if(index[offset]) {
+				index[offset] += first_record[i] + (offset < chunk.sync - base_address ? 0 : chunk.shift);
+			}
+		}
+	});
+}
 
-		if(current_cofi == nullptr) {
-			current_cofi =  new cofi_inst_t;
+uint32_t disassemble_binary(const uint8_t* code, uint64_t base_address, uint64_t max_address, cofi_map_t& cofi_map, uint32_t num_threads){
+	uint64_t code_size = max_address - base_address;
+	cofi_map.clear();
+	cofi_map.base_address = base_address;
+	cofi_map.code_size = code_size;
+	cofi_map.index_data.assign(code_size, 0);
+	uint32_t* index = cofi_map.index_data.data();
+
+	uint32_t num_chunks = std::max<uint64_t>(1, std::min<uint64_t>(num_threads, code_size / DISASM_MIN_CHUNK));
+	std::vector<disasm_chunk_t> chunks(num_chunks);
+	uint64_t start = 0;
+	for(uint32_t i = 0; i < num_chunks; i ++) {
+		chunks[i].start = base_address + start;
+		chunks[i].sync = chunks[i].start;
+		chunks[i].shift = 0;
+		uint64_t next = i + 1 == num_chunks ? code_size : std::max(start + 1, chunk_start(code, code_size, code_size / num_chunks * (i + 1)));
+		chunks[i].end = base_address + next;
+		start = next;
+	}
+	run_chunks(num_chunks, [&](uint32_t i) {
+		sweep_chunk(code, base_address, max_address, &chunks[i], index);
+	});
+	if(num_chunks == 1) {
+		cofi_map.record_data.swap(chunks[0].records);
+	}
+	else {
+		merge_chunks(code, base_address, max_address, chunks, index);
+		for(auto& chunk : chunks) {
+			cofi_map.record_data.insert(cofi_map.record_data.end(), chunk.records.begin(), chunk.records.end());
+		}
+	}
+
+	//address of the instruction after the last cofi, the end record starts there.
+	uint64_t fall_through = base_address;
+	uint32_t num_cofi_inst = cofi_map.record_data.size();
+	if(num_cofi_inst) {
+		fall_through = cofi_map.record_data.back().inst_addr + cofi_map.record_data.back().inst_size;
+	}
+	cofi_inst_t end_cofi;
+	end_cofi.type = NO_COFI_TYPE;
+	end_cofi.inst_size = 0;
+	end_cofi.is_call = false;
+	end_cofi.inst_addr = fall_through;
+	end_cofi.target_addr = 0;
+	cofi_map.record_data.push_back(end_cofi);
+	cofi_map.use_built();
+	cofi_map.build_blocks();
+	cofi_map.use_built();
+	return num_cofi_inst;
+}
+
+//a jump chain longer than this is left to the decoder, it may be a loop.
+#define BLOCK_MAX_JUMPS		64
+
+void cofi_map_t::build_blocks(){
+	block_data.clear();
+	edge_data.clear();
+	successor_data.assign(2 * record_count, 0);
+
+	//entry address and first cofi of each block, numbered by the offset of the entry.
+	std::vector<std::pair<uint64_t, uint32_t>> entries;
+	khash_t(ADDR0)* entry_index = kh_init(ADDR0);
+	auto add_entry = [&](uint64_t addr, const cofi_inst_t* cofi) -> uint32_t {
+		if(cofi == nullptr) {
+			return 0;
 		}
-		if(pre_cofi != nullptr) {
-			if(pre_cofi->next_cofi == nullptr) {
-				pre_cofi->next_cofi = current_cofi;
+		int ret;
+		khiter_t k = kh_put(ADDR0, entry_index, (uint32_t)(addr - base_address), &ret);
+		if(ret != 0) {
+			entries.push_back(std::make_pair(addr, (uint32_t)(cofi - records)));
+			kh_value(entry_index, k) = entries.size();
+		}
+		return kh_value(entry_index, k);
+	};
+	for(uint32_t i = 0; i < record_count; i ++) {
+		if(records[i].type != COFI_TYPE_CONDITIONAL_BRANCH) {
+			continue;
+		}
+		successor_data[2 * i] = add_entry(records[i].target_addr, (*this)[records[i].target_addr]);
+		//the end record may start right behind the code, take it as it is.
+		successor_data[2 * i + 1] = add_entry(records[i + 1].inst_addr, &records[i + 1]);
+	}
+	kh_destroy(ADDR0, entry_index);
+
+	//the same steps decode_tnt() takes from the entry: an edge for every jump.
+	block_data.resize(entries.size());
+	for(uint32_t i = 0; i < entries.size(); i ++) {
+		cofi_block_t& block = block_data[i];
+		const cofi_inst_t* cofi = &records[entries[i].second];
+		uint64_t last_ip = entries[i].first >> 1;
+		block.entry = entries[i].second;
+		block.entry_addr = entries[i].first;
+		block.edge_offset = edge_data.size();
+		block.num_jumps = 0;
+		block.has_call = false;
+		while(cofi->type == COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH && block.num_jumps < BLOCK_MAX_JUMPS) {
+			const cofi_inst_t* next = (*this)[cofi->target_addr];
+			if(next == nullptr) {
+				break;
 			}
+			edge_data.push_back((uint16_t)last_ip ^ (uint16_t)cofi->target_addr);
+			last_ip = cofi->target_addr >> 1;
+			block.has_call |= cofi->is_call;
+			block.num_jumps ++;
+			cofi = next;
+		}
+		block.cofi = cofi - records;
+		block.last_ip = last_ip;
+	}
+	for(auto& block : block_data) {
+		block.taken = block.fall = 0;
+		block.taken_edge = block.fall_edge = 0;
+		uint32_t i = block.cofi;
+		if(records[i].type != COFI_TYPE_CONDITIONAL_BRANCH) {
+			continue;
 		}
+		block.taken = successor_data[2 * i];
+		block.fall = successor_data[2 * i + 1];
+		block.taken_edge = (uint16_t)block.last_ip ^ (uint16_t)records[i].target_addr;
+		block.fall_edge = (uint16_t)block.last_ip ^ (uint16_t)records[i + 1].inst_addr;
+	}
+}
 
-		if (type != NO_COFI_TYPE){
-			num_cofi_inst ++;
-			current_cofi->inst_addr = insn->address;
-			current_cofi->type = get_inst_type(insn);
-			if (type == COFI_TYPE_CONDITIONAL_BRANCH || type == COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH){
-				current_cofi->target_addr = hex_to_bin(insn->op_str);
+void cofi_map_t::use_built(){
+	index = index_data.data();
+	records = record_data.data();
+	blocks = block_data.data();
+	block_edges = edge_data.data();
+	successors = successor_data.data();
+	record_count = record_data.size();
+	block_count = block_data.size();
+	edge_count = edge_data.size();
+}
+
+struct cofi_lazy_t {
+	const uint8_t* code;
+	uint64_t max_address;
+	csh handle;
+	cs_insn* insn;
+	//the map's tables, writable, in reserved memory that is only backed where it is written.
+	uint32_t* index;
+	cofi_inst_t* records;
+	size_t index_size;
+	size_t records_size;
+	std::mutex mutex;
+};
+
+bool cofi_map_t::init_lazy(const uint8_t* code, uint64_t base_address, uint64_t max_address){
+	clear();
+	cofi_lazy_t* state = new cofi_lazy_t();
+	if (cs_open(CS_ARCH_X86, CS_MODE_64, &state->handle) != CS_ERR_OK){
+		delete state;
+		return false;
+	}
+	cs_option(state->handle, CS_OPT_DETAIL, CS_OPT_ON);
+	state->insn = cs_malloc(state->handle);
+	state->code = code;
+	state->max_address = max_address;
+	uint64_t code_size = max_address - base_address;
+	//one more slot for the fall-through at the end of the code. There is at most one record per instruction.
+	state->index_size = (code_size + 1) * sizeof(uint32_t);
+	state->records_size = (code_size + 1) * sizeof(cofi_inst_t);
+	void* index_mem = mmap(nullptr, state->index_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	void* records_mem = mmap(nullptr, state->records_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(index_mem == MAP_FAILED || records_mem == MAP_FAILED) {
+		if(index_mem != MAP_FAILED) {
+			munmap(index_mem, state->index_size);
+		}
+		if(records_mem != MAP_FAILED) {
+			munmap(records_mem, state->records_size);
+		}
+		cs_free(state->insn, 1);
+		cs_close(&state->handle);
+		delete state;
+		return false;
+	}
+	state->index = (uint32_t*)index_mem;
+	state->records = (cofi_inst_t*)records_mem;
+	this->lazy = state;
+	this->base_address = base_address;
+	this->code_size = code_size;
+	this->index = state->index;
+	this->records = state->records;
+	return true;
+}
+
+const cofi_inst_t* cofi_map_t::lazy_fill(uint64_t addr, bool fall_through) const{
+	std::lock_guard<std::mutex> lock(lazy->mutex);
+	uint64_t offset = addr - base_address;
+	//another decoder may have been first.
+	if(lazy->index[offset]) {
+		return &records[lazy->index[offset] - 1];
+	}
+	//the instructions up to the next cofi, or up to code that is known already.
+	std::vector<uint64_t> offsets;
+	const cofi_inst_t* cofi = nullptr;
+	uint64_t address = addr;
+	while(true) {
+		bool known = address != addr && address - base_address <= code_size && lazy->index[address - base_address];
+		if(known) {
+			cofi = &records[lazy->index[address - base_address] - 1];
+			/* The end record of a full map starts right behind the last cofi,
+			   only a fall-through knows where that is. One reached from a TIP
+			   further on does not, the fall-through gets an end record of its own. */
+			if(cofi->type != NO_COFI_TYPE || !fall_through) {
+				break;
+			}
+		}
+		cofi_type type = NO_COFI_TYPE;
+		bool decoded = !known && decode_at(lazy->handle, lazy->insn, lazy->code, base_address, lazy->max_address, address);
+		if(decoded) {
+			type = get_inst_type(lazy->insn);
+			offsets.push_back(address - base_address);
+		}
+		else if(offsets.empty() && !fall_through) {
+			return nullptr;
+		}
+		if(!decoded || type != NO_COFI_TYPE) {
+			cofi_inst_t* record = &lazy->records[record_count];
+			if(decoded) {
+				make_cofi(lazy->insn, type, record);
 			}
 			else {
-				current_cofi->target_addr = 0;
-#ifdef DEBUG
-				printf("%lx:\t(%d)\t%s\t%s\t\t\n", insn->address, type, insn->mnemonic, insn->op_str);
-#endif	
+				//like the end record of a full map, decode_tnt() stops there.
+				record->type = NO_COFI_TYPE;
+				record->inst_size = 0;
+				record->is_call = false;
+				record->inst_addr = fall_through ? addr : address;
+				record->target_addr = 0;
+				if(offsets.empty()) {
+					offsets.push_back(offset);
+				}
 			}
-			current_cofi->next_cofi = nullptr;
-			cofi_map[insn->address] = current_cofi;
-			pre_cofi = current_cofi;
-			current_cofi = nullptr;
-		}
-		else {
-			cofi_map[insn->address] = current_cofi;
+			record_count ++;
+			cofi = record;
+			break;
 		}
+		address += lazy->insn->size;
 	}
+	//published last, readers take the record as soon as they see the index entry.
+	for(uint64_t entry : offsets) {
+		__atomic_store_n(&lazy->index[entry], (uint32_t)(cofi - records) + 1, __ATOMIC_RELEASE);
+	}
+	return cofi;
+}
 
-	cs_free(insn, 1);
-	cs_close(&handle);
-	return num_cofi_inst;
+void cofi_map_t::clear(){
+	if(lazy != nullptr) {
+		munmap(lazy->index, lazy->index_size);
+		munmap(lazy->records, lazy->records_size);
+		cs_free(lazy->insn, 1);
+		cs_close(&lazy->handle);
+		delete lazy;
+		lazy = nullptr;
+		record_count = 0;
+	}
+	if(mapping != nullptr) {
+		munmap(mapping, mapping_size);
+		mapping = nullptr;
+		mapping_size = 0;
+	}
+	index_data.clear();
+	record_data.clear();
+	block_data.clear();
+	edge_data.clear();
+	successor_data.clear();
+	base_address = code_size = 0;
+	use_built();
+}
+
+cofi_map_t::~cofi_map_t(){
+	clear();
 }
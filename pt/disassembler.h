@@ -33,8 +33,8 @@ along with QEMU-PT.  If not, see <http://www.gnu.org/licenses/>.
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <map>
 #include <string>
+#include <vector>
 
 //~ #include "qemu/osdep.h"
 #include "khash.h"
@@ -89,37 +89,158 @@ typedef struct disassembler_s{
 //#define DEBUG_COFI_INST
 typedef struct _cofi_inst_t {
 	cofi_type type;
+	//near calls, they return to inst_addr + inst_size.
+	uint8_t inst_size;
+	bool is_call;
 	uint64_t inst_addr;
 	uint64_t target_addr;
-	struct _cofi_inst_t* next_cofi;
 #ifdef DEBUG_COFI_INST
 	std::string dis_inst;
 #endif
 } cofi_inst_t;
 
-class my_cofi_map {
-	cofi_inst_t** map_data;
-	uint64_t base_address;
-	uint32_t code_size;
+/* Basic block of the cofi map's block graph, see cofi_map_t. A block is
+   entered at the target of a conditional branch or at the cofi behind one,
+   takes the direct jumps and calls from there in one go and ends at the
+   next other cofi. For a conditional branch at the end both successors and
+   the bitmap indices of the edges into them are known up front, so the
+   decoder walks from block to block without looking up any address.
+   Records and blocks are referred to by number, the graph is the same
+   wherever the map is loaded. */
+typedef struct _cofi_block_t {
+	uint32_t entry;					//record number of the first cofi of the block
+	uint32_t cofi;					//record number of the cofi it ends at, a direct jump if the chain was cut
+	uint32_t taken;					//block number + 1 of the successors at a conditional branch, taken is 0 if the target is no instruction
+	uint32_t fall;
+	uint64_t entry_addr;
+	uint64_t last_ip;				//decoder's bitmap_last_ip once at cofi
+	uint32_t edge_offset;			//first of num_jumps bitmap indices in cofi_map_t::block_edges
+	uint16_t num_jumps;				//direct jumps and calls taken on the way to cofi
+	uint16_t taken_edge;
+	uint16_t fall_edge;
+	//one of the jumps is a call, its return address has to be pushed with compressed returns.
+	bool has_call;
+} cofi_block_t;
+
+/* Flat lookup table from instruction address to the first cofi at or after
+   that address. index has one slot per code byte holding the record number
+   plus one, 0 for bytes that do not start an instruction. records are in
+   address order, so the fall-through cofi of a record is the next one in the
+   array; a NO_COFI_TYPE record at the end stands for the instructions behind
+   the last cofi. Filled by disassemble_binary(), read-only afterwards.
+
+   The tables are plain arrays, so they can also be written to a file and
+   mapped back read-only (see cofi_cache.h): lookups go through pointers to
+   either the map's own vectors or the mapping.
+
+   A lazy map (init_lazy()) starts out empty and disassembles code the first
+   time it is looked up, from the address looked up to the next cofi, the
+   way the old kAFL disassembler does on a miss. Its records come in the
+   order they were reached, so the fall-through of a record is looked up
+   too, and there is no block graph. Cold code is never disassembled and
+   only the pages of the tables that were written take memory. */
+struct cofi_lazy_t;
+
+class cofi_map_t {
+	uint64_t base_address = 0;
+	uint64_t code_size = 0;
+	//built by disassemble_binary(), empty for a mapped cache file.
+	std::vector<uint32_t> index_data;
+	std::vector<cofi_inst_t> record_data;
+	std::vector<cofi_block_t> block_data;
+	std::vector<uint16_t> edge_data;
+	std::vector<uint32_t> successor_data;
+
+	const uint32_t* index = nullptr;
+	const cofi_inst_t* records = nullptr;
+	const cofi_block_t* blocks = nullptr;
+	const uint16_t* block_edges = nullptr;
+	//per record: block number + 1 of the taken and the fall-through successor of a conditional branch, 0 for none.
+	const uint32_t* successors = nullptr;
+	//grows with a lazy map.
+	mutable uint32_t record_count = 0;
+	uint32_t block_count = 0;
+	uint32_t edge_count = 0;
+	void* mapping = nullptr;
+	size_t mapping_size = 0;
+	cofi_lazy_t* lazy = nullptr;
+
+	friend uint32_t disassemble_binary(const uint8_t* code, uint64_t base_address, uint64_t max_address, cofi_map_t& cofi_map, uint32_t num_threads);
+	void build_blocks();
+	void use_built();
+	void clear();
+	//fall_through: reached by not taking a branch, a record is made even if there is no instruction.
+	const cofi_inst_t* lazy_fill(uint64_t addr, bool fall_through) const;
 public:
-	my_cofi_map(uint64_t base_address, uint32_t code_size) : base_address(base_address), code_size(code_size) {
-		map_data = (cofi_inst_t**)malloc(sizeof(cofi_inst_t*) * code_size);
+	cofi_map_t() = default;
+	cofi_map_t(const cofi_map_t&) = delete;
+	cofi_map_t& operator =(const cofi_map_t&) = delete;
+	~cofi_map_t();
+	//nullptr if addr is out of range or not the start of an instruction.
+	inline const cofi_inst_t* operator [](uint64_t addr) const {
+		uint64_t offset = addr - base_address;
+		if(offset >= code_size) {
+			return nullptr;
+		}
+		//a lazy map is filled in by other decoder threads while it is read.
+		uint32_t i = __atomic_load_n(&index[offset], __ATOMIC_ACQUIRE);
+		if(i) {
+			return &records[i - 1];
+		}
+		return lazy ? lazy_fill(addr, false) : nullptr;
 	}
-	~my_cofi_map() {
-		free(map_data);
+	//the cofi reached when a conditional branch is not taken.
+	inline const cofi_inst_t* next(const cofi_inst_t* cofi) const {
+		if(lazy == nullptr) {
+			return cofi + 1;
+		}
+		uint64_t addr = cofi->inst_addr + cofi->inst_size;
+		uint32_t i = __atomic_load_n(&index[addr - base_address], __ATOMIC_ACQUIRE);
+		return i ? &records[i - 1] : lazy_fill(addr, true);
 	}
-	inline cofi_inst_t*& operator [](uint64_t addr) {
-		return map_data[addr-base_address];
+	uint64_t get_base_address() const { return base_address; }
+	uint64_t get_code_size() const { return code_size; }
+	//number of records, the end record included.
+	uint32_t size() const { return record_count; }
+	const cofi_inst_t* begin() const { return records; }
+	inline const cofi_inst_t* get_record(uint32_t i) const {
+		return &records[i];
 	}
+	//block number + 1 as stored in cofi_block_t, nullptr for 0.
+	inline const cofi_block_t* get_block(uint32_t n) const {
+		return n ? &blocks[n - 1] : nullptr;
+	}
+	//blocks entered when the conditional branch cofi is taken or not, nullptr if there is none.
+	inline const cofi_block_t* taken_block(const cofi_inst_t* cofi) const {
+		return get_block(successors[2 * (cofi - records)]);
+	}
+	inline const cofi_block_t* fall_block(const cofi_inst_t* cofi) const {
+		return get_block(successors[2 * (cofi - records) + 1]);
+	}
+	inline const uint16_t* get_block_edges(const cofi_block_t* block) const {
+		return block_edges + block->edge_offset;
+	}
+	uint32_t num_blocks() const { return block_count; }
+
+	/* Cache files, implemented in cofi_cache.cpp. load() maps the file
+	   read-only and checks that it was saved by this version for the given
+	   key and code range, on failure the map is left empty. */
+	bool load(const char* path, uint64_t key, uint64_t base_address, uint64_t code_size);
+	bool save(const char* path, uint64_t key) const;
+	bool is_mapped() const { return mapping != nullptr; }
+
+	//make this a lazy map over code, which has to stay around as long as the map.
+	bool init_lazy(const uint8_t* code, uint64_t base_address, uint64_t max_address);
+	bool is_lazy() const { return lazy != nullptr; }
 };
 
-typedef std::map<uint64_t, cofi_inst_t*> cofi_map_t;
-
 disassembler_t* init_disassembler(uint8_t* code, uint64_t min_addr, uint64_t max_addr, uint64_t entry_point, void (*handler)(uint64_t));
 bool reset_disassembler(disassembler_t* self);
 bool trace_disassembler(disassembler_t* self, uint64_t entry_point, bool isr, tnt_cache_t* tnt_cache_state);
 void destroy_disassembler(disassembler_t* self);
 void free_list(cofi_list* head);
 
-uint32_t disassemble_binary(const uint8_t* code, uint64_t base_address, uint64_t max_address, cofi_map_t& cofi_map);
+//linear sweep over [base_address, max_address). With num_threads > 1 the code is split into chunks that are swept in parallel,
+//the map is the same either way.
+uint32_t disassemble_binary(const uint8_t* code, uint64_t base_address, uint64_t max_address, cofi_map_t& cofi_map, uint32_t num_threads = 1);
 #endif
@@ -35,14 +35,27 @@
 #include <wait.h>
 #include <iostream>
 #include <chrono>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include "disassembler.h"
 #include "pt_ext.h"
+#include "pt_trace_file.h"
+#include "tnt_run_cache.h"
+#include "pt_config.h"
 //~ #include "tnt_cache.h"
 
 /* Size (in bytes) for report data to be stored in stack before written to file */
 #define _HF_REPORT_SIZE 8192
 #define _HF_PERF_MAP_SZ (1024 * 512)
 #define _HF_PERF_AUX_SZ (1024 * 1024)
+//bounds of AFL_PT_AUX_SIZE=auto.
+#define PT_AUX_MIN_SZ (64 * 1024)
+#define PT_AUX_MAX_SZ (64 * 1024 * 1024)
+//return addresses the decoder keeps for compressed returns, deeper calls lose the oldest.
+#define PT_RET_STACK_SIZE 64
 #define _HF_PERF_BITMAP_SIZE_16M (1024U * 1024U * 16U)
 #define _HF_PERF_BITMAP_BITSZ_MASK 0x7ffffff
 
@@ -86,7 +99,7 @@
 #define PT_PKT_CBR_BYTE0		PT_PKT_GENERIC_BYTE0
 #define PT_PKT_CBR_BYTE1		0b00000011
 
-#define PT_PKT_OVF_LEN			8
+#define PT_PKT_OVF_LEN			2
 #define PT_PKT_OVF_BYTE0		PT_PKT_GENERIC_BYTE0
 #define PT_PKT_OVF_BYTE1		0b11110011
 
@@ -126,6 +139,35 @@
 #define PT_PKT_TIP_PGD_BYTE0	0b00000001
 #define PT_PKT_TIP_FUP_BYTE0	0b00011101
 
+#define PT_PKT_CYC_MASK			0b00000011
+#define PT_PKT_CYC_BYTE0		0b00000011
+#define PT_PKT_CYC_EXT			0b00000100
+
+/* Packet kinds used by the table-driven dispatcher in pt_packet_decoder::decode().
+   The first byte of every packet selects an entry in a 256-entry table; the
+   0x02 extended opcodes take a second lookup on the next byte. */
+typedef enum {
+	PT_OP_UNKNOWN = 0,
+	PT_OP_PAD,
+	PT_OP_SKIP,		/* fixed-length packet we do not care about, skip desc.len bytes */
+	PT_OP_TNT8,
+	PT_OP_TIP,
+	PT_OP_TIP_PGE,
+	PT_OP_TIP_PGD,
+	PT_OP_TIP_FUP,
+	PT_OP_CYC,
+	PT_OP_EXT,
+	PT_OP_PSB,
+	PT_OP_LTNT,
+	PT_OP_MNT,
+	PT_OP_OVF,
+} pt_opcode_kind;
+
+typedef struct {
+	uint8_t kind;
+	uint8_t len;
+} pt_opcode_desc;
+
 typedef struct {
     uint64_t newBBCnt;
 }hwcnt_t;
@@ -209,11 +251,12 @@ typedef struct binary_info_t {
 	uint64_t entry_point;
 };
 
+class pt_parallel_decoder;
+
 class pt_packet_decoder{
 	uint64_t min_address;
 	uint64_t max_address;
 	uint64_t app_entry_point;
-	uint64_t last_tip = 0;
 	uint64_t last_ip2 = 0;
 	bool start_decode = false;
 
@@ -225,26 +268,86 @@ class pt_packet_decoder{
 	uint64_t aux_head;
 	uint64_t aux_tail;
 	uint8_t* pt_packets;
+	uint64_t trace_size;
+	//set when decoding straight from the perf aux ring.
+	uint8_t* perf_pt_header = nullptr;
+
+	//streaming state: whether packet boundaries are known, and the bytes of a
+	//packet cut off by the end of the last chunk.
+	bool synced = false;
+	uint8_t carry[64];
+	uint64_t carry_len = 0;
+
+	const cofi_map_t& cofi_map;
+	tnt_run_cache* run_cache;
+	//walk conditional branches the run cache does not take along the map's block graph.
+	bool use_blocks = false;
+
+	/* The walk through the cofi map goes on from packet to packet. It waits
+	   at walk_cofi: a conditional branch that needs more TNT, or, with
+	   walk_at_tip, an indirect branch or uncompressed return whose target
+	   the next TIP gives. nullptr when there is nothing to go on from, after
+	   a far transfer or PSB. The edge to where a walk was continued is only
+	   recorded when it moves on from there: PSB drops a walk that has not,
+	   and the FUP of PSB+ names the same address again. */
+	const cofi_inst_t* walk_cofi = nullptr;
+	bool walk_at_tip = false;
+	uint64_t walk_edge_ip = 0;
+	//TNT bits were lost to a full TNT cache, no walk is started before the next PSB.
+	bool wait_psb = false;
+
+	/* With RET compression a return to the instruction after its call is
+	   only a taken TNT bit, the target comes from this shadow stack. A
+	   return with a TIP does not touch it, and PSB empties it like the
+	   cpu's own. */
+	bool ret_compression = false;
+	uint64_t ret_stack[PT_RET_STACK_SIZE];
+	uint32_t ret_top = 0;
+	uint32_t ret_depth = 0;
 
-	cofi_map_t& cofi_map;
 	uint64_t bitmap_last_ip = 0;
-	uint8_t* trace_bits;
+	//address of the first edge's target, pt_parallel_decoder joins it to the previous segment.
+	uint64_t first_edge_addr = 0;
+	uint8_t* trace_bits = nullptr;
+	//false when decoding into the caller's bitmap.
+	bool own_trace_bits = false;
+
+	friend class pt_parallel_decoder;
 public:
     uint64_t num_decoded_branch = 0;
+	//TNT bits lost to a full TNT cache, the edges they lead to are missing from the bitmap.
+	uint64_t num_tnt_dropped = 0;
 public:
-	pt_packet_decoder(uint8_t* perf_pt_header, uint8_t* perf_pt_aux, cofi_map_t& map, uint64_t min_address, uint64_t max_address, uint64_t entry_point);
+	//run_cache is optional, with it decode_tnt() applies whole TNT runs at once.
+	pt_packet_decoder(uint8_t* perf_pt_header, uint8_t* perf_pt_aux, const cofi_map_t& map, uint64_t min_address, uint64_t max_address, uint64_t entry_point,
+			tnt_run_cache* run_cache = nullptr);
+	//decode a raw trace that is already in memory, e.g. a recorded aux buffer.
+	pt_packet_decoder(uint8_t* trace, uint64_t trace_size, const cofi_map_t& map, uint64_t min_address, uint64_t max_address, uint64_t entry_point,
+			tnt_run_cache* run_cache = nullptr);
+	//a decoder to reset() before each trace, instead of constructing one per execution.
+	pt_packet_decoder(const cofi_map_t& map, uint64_t min_address, uint64_t max_address, uint64_t entry_point, tnt_run_cache* run_cache = nullptr);
 	~pt_packet_decoder();
+	/* Start over on a new trace, as if freshly constructed. With trace_bits
+	   the edges are counted straight into that bitmap, which the caller has
+	   zeroed; without it the decoder's own bitmap is cleared and used. */
+	void reset(uint8_t* perf_pt_header, uint8_t* perf_pt_aux, uint8_t* trace_bits = nullptr);
+	void reset(uint8_t* trace, uint64_t trace_size, uint8_t* trace_bits = nullptr);
+	//the trace picks up after the entry point with tracing on: a segment of a longer trace, or the end of one.
+	void start_mid_trace() { start_decode = true; pge_enabled = true; }
+	//the trace was recorded with RET compression, the run cache has to stop at calls then.
+	void set_ret_compression(bool on) { ret_compression = on; }
 	void decode();
+	/* Streaming interface: chunks are decoded as one continuous trace, a
+	   packet cut off at the end of a chunk is finished with the next one. */
+	void decode_chunk(uint8_t* data, uint64_t size);
+	//decode what was written to the aux ring since the last call and advance aux_tail, returns the bytes consumed.
+	uint64_t decode_aux();
 	uint8_t* get_trace_bits() { return trace_bits; }
 private:
+	void reset_state(uint8_t* trace_bits);
+	uint8_t* decode_packets(uint8_t* p, uint8_t* end);
 	uint64_t get_ip_val(unsigned char **pp, unsigned char *end, int len, uint64_t *last_ip);
 	inline void tip_handler(uint8_t** p, uint8_t** end){
-#ifdef DEBUG
-        //std::cout << "tip: " << count_tnt(this->tnt_cache_state) << std::endl;
-#endif
-		//if (count_tnt(this->tnt_cache_state)){
-		//	decode_tnt(this->last_tip);
-		//}
 		uint64_t tip = get_ip_val(p, *end, (*(*p)++ >> PT_PKT_TIP_SHIFT), &this->last_ip2);
         if(tip == app_entry_point) {
 #ifdef DEBUG
@@ -252,50 +355,41 @@ private:
 #endif
             this->start_decode = true;
         }
-        //if(this->start_decode) 
 #ifdef DEBUG
         std::cout << "tip: " << std::hex << tip << std::endl;
 #endif
-        if(this->start_decode && this->last_tip != 0){
-        	decode_tnt(this->last_tip);
+        if(!this->start_decode) {
+        	return;
         }
-        if(out_of_bounds(tip)) {
-        	this->last_tip = 0;
+        decode_tnt();
+#ifdef DEBUG
+        if(this->walk_cofi != nullptr && !this->walk_at_tip) {
+        	std::cout << "tip while waiting for TNT at " << std::hex << this->walk_cofi->inst_addr << std::endl;
         }
-        else{
-        	this->last_tip = tip;
-		}
+#endif
+        follow_ip(tip);
 	}
 
 	inline void tip_pge_handler(uint8_t** p, uint8_t** end){
-#ifdef DEBUG
-        //std::cout << "tip_pge_handler" << std::endl;
-#endif
 		this->pge_enabled = true;
-		this->last_tip = get_ip_val(p, *end, (*(*p)++ >> PT_PKT_TIP_SHIFT), &this->last_ip2);
-        if(last_tip == app_entry_point) {
+		uint64_t ip = get_ip_val(p, *end, (*(*p)++ >> PT_PKT_TIP_SHIFT), &this->last_ip2);
+        if(ip == app_entry_point) {
 #ifdef DEBUG
             std::cout << "enter program entry point" << std::endl;
 #endif
             this->start_decode = true;
         }
-        //if(this->start_decode) 
 #ifdef DEBUG
-        std::cout << "tip_pge: " << std::hex << last_tip << std::endl;
+        std::cout << "tip_pge: " << std::hex << ip << std::endl;
 #endif
-        if(out_of_bounds(last_tip)) {
-        	this->last_tip = 0;
+        //back where tracing was switched off (an interrupt), the walk just goes on.
+        if(this->start_decode && !walk_is_at(ip)) {
+        	follow_ip(ip);
         }
 	}
 
 	inline void tip_pgd_handler(uint8_t** p, uint8_t** end){
-#ifdef DEBUG
-        //std::cout << "enter tip_pgd_handler" << std::endl;
-#endif
 		this->pge_enabled = false;
-		//if (count_tnt(this->tnt_cache_state)){
-		//	decode_tnt(this->last_tip);
-		//}
 		uint64_t tip = get_ip_val(p, *end, (*(*p)++ >> PT_PKT_TIP_SHIFT), &this->last_ip2);
         if(tip == app_entry_point) {
 #ifdef DEBUG
@@ -303,28 +397,18 @@ private:
 #endif
             this->start_decode = true;
         }
-        //if(this->start_decode) 
 #ifdef DEBUG
         std::cout << "tip_pgd: " << std::hex << tip << std::endl;
 #endif
-        if(this->start_decode && this->last_tip != 0){
-        	decode_tnt(this->last_tip);
-        }
-        if(out_of_bounds(tip)) {
-        	this->last_tip = 0;
+        decode_tnt();
+        //the indirect branch it waited at left the traced code.
+        if(this->walk_at_tip) {
+        	this->walk_cofi = nullptr;
+        	this->walk_at_tip = false;
         }
-        else{
-        	this->last_tip = tip;
-		}
 	}
 
 	inline void tip_fup_handler(uint8_t** p, uint8_t** end){
-#ifdef DEBUG
-        //std::cout << "enter tip_fup_handler" << std::endl;
-#endif
-		//if (count_tnt(this->tnt_cache_state)){
-		//	decode_tnt(this->last_tip);
-		//}
 		uint64_t tip = get_ip_val(p, *end, (*(*p)++ >> PT_PKT_TIP_SHIFT), &this->last_ip2);
         if(tip == app_entry_point) {
 #ifdef DEBUG
@@ -332,20 +416,17 @@ private:
 #endif
             this->start_decode = true;
         }
-        //if(this->start_decode) 
 #ifdef DEBUG
         std::cout << "tip_fup: " << std::hex << tip << std::endl;
 #endif
-        if(this->start_decode && this->last_tip != 0){
-        	decode_tnt(this->last_tip);
-    	}
-        if(out_of_bounds(tip)) {
-        	this->last_tip = 0;
+        if(!this->start_decode) {
+        	return;
+        }
+        decode_tnt();
+        //an async event where the walk already is needs no edge, the FUP of PSB+ starts a new walk.
+        if(!walk_is_at(tip)) {
+        	follow_ip(tip);
         }
-        else{
-        	this->last_tip = tip;
-		}
-
 	}
 
 	inline void psb_handler(uint8_t** p){
@@ -353,9 +434,38 @@ private:
 		std::cout << "psb packet" << std::endl;
 #endif
 		(*p) += PT_PKT_PSB_LEN;
+		//TNT before it still belongs to the walk going on, the FUP of PSB+ starts over.
+		if(count_tnt(this->tnt_cache_state)) {
+			decode_tnt();
+		}
+		flush();
+		this->wait_psb = false;
+	}
+
+	inline void ovf_handler(uint8_t** p){
+#ifdef DEBUG
+		std::cout << "ovf packet" << std::endl;
+#endif
+		(*p) += PT_PKT_OVF_LEN;
+		//packets were lost: the walk goes as far as what came before takes it, the FUP or TIP.PGE after it resumes with a full IP.
+		decode_tnt();
 		flush();
 	}
 
+	inline bool cyc_handler(uint8_t** p, uint8_t* end){
+		//CYC is variable length: bit 2 of the header and bit 0 of every payload byte say "more follows".
+		uint8_t* q = *p;
+		if(*q++ & PT_PKT_CYC_EXT){
+			do {
+				if(q == end) {
+					return false;
+				}
+			} while(*q++ & 1);
+		}
+		*p = q;
+		return true;
+	}
+
     void print_tnt(tnt_cache_t* tnt_cache);
 	inline void tnt8_handler(uint8_t** p){
         //uint64_t old_count = count_tnt(tnt_cache_state);
@@ -368,8 +478,11 @@ private:
 #endif
 		if (this->start_decode && this->pge_enabled) {
         	//tnt_cache_t* tnt_cache = tnt_cache_init();
-        	if(this->last_tip != 0){
+        	if(this->walk_cofi != nullptr){
 				append_tnt_cache(tnt_cache_state, true, (uint64_t)(**p));
+				if(tnt_cache_state->dropped) {
+					tnt_overflow();
+				}
 				//print_tnt(tnt_cache_state);
 #ifdef DEBUG
         		std::cout << "count_tnt: " << count_tnt(tnt_cache_state) << std::endl;
@@ -386,12 +499,15 @@ private:
 
 	inline void long_tnt_handler(uint8_t** p){
 #ifdef DEBUG
-		std::cout << "long tnt: " << count_tnt_bits(true, (uint64_t)(**p)) << std::endl;;
+		std::cout << "long tnt: " << count_tnt_bits(false, *(uint64_t*)(*p)) << std::endl;;
 #endif
 		if (this->start_decode && this->pge_enabled) {
         	//tnt_cache_t* tnt_cache = tnt_cache_init();
-        	if(this->last_tip != 0){
-	        	append_tnt_cache(tnt_cache_state, false, (uint64_t)*p);
+        	if(this->walk_cofi != nullptr){
+	        	append_tnt_cache(tnt_cache_state, false, *(uint64_t*)(*p));
+				if(tnt_cache_state->dropped) {
+					tnt_overflow();
+				}
 #ifdef DEBUG
         		std::cout << "count_tnt: " << count_tnt(tnt_cache_state) << std::endl;
 #endif
@@ -408,7 +524,27 @@ private:
 	}
 
 	void flush();
-	uint32_t decode_tnt(uint64_t entry_point);
+	//the TNT cache ran full: decode what it holds and drop the walk until the next PSB.
+	void tnt_overflow();
+	//go on with the walk as far as the pending TNT bits take it.
+	uint32_t decode_tnt();
+	/* From the conditional branch cofi_obj along the block graph until the
+	   TNT runs out (the branch it waits at is returned) or a block ends at
+	   another cofi, which is returned for decode_tnt() to go on with. */
+	const cofi_inst_t* walk_blocks(const cofi_inst_t* cofi_obj, uint32_t* num_tnt_decoded);
+	const cofi_inst_t* leave_blocks(const cofi_inst_t* cofi_obj, uint32_t* num_tnt_decoded);
+	//continue the walk at ip: the target of the indirect branch it waits at, or a new start.
+	void follow_ip(uint64_t ip);
+	inline bool walk_is_at(uint64_t ip) {
+		return this->walk_cofi != nullptr && !out_of_bounds(ip) && this->cofi_map[ip] == this->walk_cofi;
+	}
+	inline void push_ret(const cofi_inst_t* call) {
+		ret_stack[ret_top] = call->inst_addr + call->inst_size;
+		ret_top = (ret_top + 1) % PT_RET_STACK_SIZE;
+		if(ret_depth < PT_RET_STACK_SIZE) {
+			ret_depth ++;
+		}
+	}
 	inline void alter_bitmap(uint64_t addr) {
 		//64位地址截断为16位
 	    uint16_t last_ip16, addr16, pos16;
@@ -421,18 +557,92 @@ private:
 };
 
 
+/* Decodes the aux ring of the attached decoder while the traced process is
+   still running, so stop_pt_trace() is only left with what arrived since the
+   last poll. One thread serves all executions: attach() hands it the decoder
+   of the current one, detach() takes it back, after which the caller drains
+   the rest with decode_aux(). The kernel only moves aux_head on a PMI, set
+   pt_tracer::aux_watermark to get them before the ring is full. */
+class pt_decode_thread {
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	pt_packet_decoder* decoder = nullptr;
+	std::atomic<bool> detaching{false};
+	bool quit = false;
+public:
+	//microseconds to sleep when the ring had nothing new.
+	uint32_t poll_interval = 50;
+public:
+	//cpu >= 0 pins the thread to that cpu.
+	pt_decode_thread(int cpu = -1);
+	~pt_decode_thread();
+	void attach(pt_packet_decoder* decoder);
+	void detach();
+private:
+	void run();
+};
+
+/* The header and aux mappings of a whole fuzzing session. An event can not be
+   moved to another process, but one that is bound to a cpu may write into the
+   ring of another event on the same cpu (PERF_EVENT_IOC_SET_OUTPUT). The pool
+   maps the ring of a holder event that is never enabled, and every child's
+   event is opened on the same cpu and redirected there. An exec then costs a
+   perf_event_open, an ioctl and a close instead of two mmaps, two munmaps and
+   a freshly allocated aux buffer. The children have to stay on that cpu. */
+class pt_tracer_pool {
+	int cpu;
+	int holder_fd = -1;
+	uint8_t* perf_pt_header = nullptr;
+	uint8_t* perf_pt_aux = nullptr;
+	uint64_t aux_size = _HF_PERF_AUX_SZ;
+public:
+	pt_tracer_pool(int cpu);
+	~pt_tracer_pool();
+	bool open(int pt_perf_type, uint64_t config, uint32_t aux_watermark, uint64_t aux_size);
+	//start the next run with an empty ring.
+	void reset();
+	int get_cpu() { return cpu; }
+	int get_fd() { return holder_fd; }
+	uint64_t get_aux_size() { return aux_size; }
+	uint8_t* get_perf_pt_header() { return perf_pt_header; }
+	uint8_t* get_perf_pt_aux() { return perf_pt_aux; }
+};
+
 class pt_tracer {
 	uint8_t* perf_pt_header;
 	uint8_t* perf_pt_aux;
 	int trace_pid;
 	int perf_fd = -1;
+	//set when the mappings belong to a pt_tracer_pool.
+	pt_tracer_pool* pool = nullptr;
 	//pt_decode_info_t decode_info;
+public:
+	//bytes of new trace after which the kernel publishes aux_head, 0 for the default (half the ring).
+	uint32_t aux_watermark = 0;
+	//size of the aux ring, a power of two number of pages.
+	uint64_t aux_size = _HF_PERF_AUX_SZ;
+	//start tracing when the process execs. A forked child that does not exec has to be started with start_trace().
+	bool enable_on_exec = true;
+	//attr.config of the event, see pt_config.h.
+	uint64_t config = PT_CONFIG_DEFAULT;
+	//map the aux ring read-only, the kernel then overwrites the oldest data instead of stopping when it is full.
+	bool snapshot = false;
 public:
 	pt_tracer(int pid) ;
 	bool open_pt(int pt_perf_type);
+	//trace into the pool's ring instead of mapping one of our own.
+	bool open_pt(int pt_perf_type, pt_tracer_pool* pool);
 	bool start_trace();
 	bool stop_trace();
 	void close_pt();
+	//drop whatever is left in the rings, before the event is enabled again.
+	void reset();
+	//PERF_RECORD_AUX with the truncated flag or PERF_RECORD_LOST since the last call, i.e. the ring ran full.
+	uint32_t count_truncated();
+	//PERF_EVENT_IOC_SET_FILTER, see pt_filter.h.
+	bool set_filter(const char* filter);
+	int get_pid() { return trace_pid; }
 	uint8_t* get_perf_pt_header() { return perf_pt_header; }
 	uint8_t* get_perf_pt_aux() { return perf_pt_aux; }
 };
@@ -444,23 +654,84 @@ class pt_fuzzer {
 	uint64_t entry_point;
 
 	int32_t perfIntelPtPerfType = -1;
+	//built in config_pt(), AFL_PT_PSB_PERIOD sets the PSB period.
+	uint64_t pt_config = PT_CONFIG_DEFAULT;
+	//AFL_PT_RET_COMPRESSION: let the cpu compress returns, the decoders follow them with a shadow stack.
+	bool ret_compression = false;
 	cofi_map_t cofi_map;
+	//TNT runs learned so far, shared by the decoders of all executions.
+	tnt_run_cache* run_cache = nullptr;
 	uint8_t* code;
 
 	pt_tracer* trace;
 
+	//raw traces are written here when AFL_PT_CAPTURE_DIR is set.
+	std::string capture_dir;
+	uint32_t capture_count = 0;
+	uint32_t capture_max = 0;
+
+	//AFL_PT_DECODE_THREAD: decode while the target runs.
+	pt_decode_thread* decode_thread = nullptr;
+	//reset() for every trace, decodes into out_bits when the fuzzer registered its bitmap.
+	pt_packet_decoder* decoder = nullptr;
+	uint8_t* out_bits = nullptr;
+	//AFL_PT_DECODE_JOBS: split each trace at PSBs over this many threads.
+	pt_parallel_decoder* parallel_decoder = nullptr;
+	std::vector<uint8_t> linear_trace;
+
+	//mappings kept across execs, unless AFL_PT_NO_POOL is set or the fuzzer is not bound to one cpu.
+	pt_tracer_pool* tracer_pool = nullptr;
+	bool tracer_pool_off = false;
+
+	//the target runs from a fork server, its children never exec.
+	bool fork_server = false;
+
+	//address filter for each child's event, empty to trace all user mode code.
+	std::string filter;
+
+	//AFL_PT_AUX_SIZE: aux ring of each trace. With auto_aux it is sized from the largest trace seen so far,
+	//and doubled after an overflow.
+	uint64_t aux_size = _HF_PERF_AUX_SZ;
+	bool auto_aux = false;
+	uint64_t aux_start = 0;
+	uint64_t max_trace_volume = 0;
+
+	/* AFL_PT_SNAPSHOT: trace into an overwritten ring and decode only its last
+	   snapshot_size bytes, from the first PSB in them. The decode time stays
+	   bounded however long the target runs, at the price of the coverage of
+	   everything before. Each exec gets a fresh (zeroed, i.e. PAD) ring, so no
+	   older trace ends up in the window. */
+	uint64_t snapshot_size = 0;
+
 public:
 	pt_fuzzer(std::string raw_binary_file, uint64_t base_address, uint64_t max_address, uint64_t entry_point);
 	void init();
 	void start_pt_trace(int pid);
-	void stop_pt_trace(uint8_t *trace_bits);
+	//keep_tracer: the child is stopped between persistent mode iterations, its event is enabled again on the next start_pt_trace().
+	void stop_pt_trace(uint8_t *trace_bits, bool keep_tracer = false);
+	void set_fork_server(bool on) { fork_server = on; }
+	void set_target(const char* path);
+	void set_trace_bits(uint8_t* bits) { out_bits = bits; }
+	//AFL_PT_AUX_SIZE=auto: size the ring for the traces seen so far (calibration), returns the size.
+	uint64_t tune_aux_size();
+	uint32_t num_cofi_inst() const { return cofi_map.size(); }
 	std::chrono::time_point<std::chrono::steady_clock> start;
 	std::chrono::time_point<std::chrono::steady_clock> end;
 	std::chrono::duration<double> diff;
+	pt_fuzzer_stats_t stats = {};
 private:
 	bool load_binary();
 	bool build_cofi_map();
 	bool config_pt();
+	void capture_trace();
+	void decode_parallel(uint8_t* trace_bits);
+	//[tail, head) of the ring in one piece, copied into linear_trace if it wraps.
+	uint8_t* linear_aux(uint64_t tail, uint64_t head);
+	void snapshot_bounds(uint64_t* tail, uint64_t* head);
+	void decode_snapshot(uint8_t* trace_bits);
+	void open_tracer_pool();
+	void resume_trace();
+	void finish_exec(bool keep_tracer);
 
 	bool open_pt();
 
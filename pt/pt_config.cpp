@@ -0,0 +1,86 @@
+#include "pt_config.h"
+#include <stdio.h>
+#include <iostream>
+
+#define PT_SYSFS "/sys/bus/event_source/devices/intel_pt/"
+//a PSB period field of n means 2^(n + 11) bytes.
+#define PT_PSB_PERIOD_SHIFT 11
+
+//bits [lo, hi] of attr.config, from format/<name>.
+static bool read_format(const char* name, uint32_t* lo, uint32_t* hi) {
+	char path[256];
+	snprintf(path, sizeof(path), PT_SYSFS "format/%s", name);
+	FILE* fp = fopen(path, "r");
+	if(fp == nullptr) {
+		return false;
+	}
+	int n = fscanf(fp, "config:%u-%u", lo, hi);
+	fclose(fp);
+	if(n == 1) {
+		*hi = *lo;
+	}
+	return n >= 1 && *lo <= *hi && *hi < 64;
+}
+
+//caps/<name>, which the kernel prints in hex.
+static bool read_cap(const char* name, uint32_t* value) {
+	char path[256];
+	snprintf(path, sizeof(path), PT_SYSFS "caps/%s", name);
+	FILE* fp = fopen(path, "r");
+	if(fp == nullptr) {
+		return false;
+	}
+	bool ok = fscanf(fp, "%x", value) == 1;
+	fclose(fp);
+	return ok;
+}
+
+static bool set_field(uint64_t* config, const char* name, uint64_t value) {
+	uint32_t lo, hi;
+	if(!read_format(name, &lo, &hi)) {
+		return false;
+	}
+	uint64_t mask = hi - lo == 63 ? ~0ULL : ((1ULL << (hi - lo + 1)) - 1);
+	if(value > mask) {
+		return false;
+	}
+	*config = (*config & ~(mask << lo)) | (value << lo);
+	return true;
+}
+
+//largest supported field value whose period is at most bytes, else the smallest supported one. -1 if the period is fixed.
+static int psb_period_field(uint64_t bytes) {
+	uint32_t psb_cyc = 0, periods = 0;
+	if(!read_cap("psb_cyc", &psb_cyc) || !psb_cyc || !read_cap("psb_periods", &periods) || periods == 0) {
+		return -1;
+	}
+	int field = -1;
+	for(int n = 0; n < 16; n ++) {
+		if(!(periods & (1U << n))) {
+			continue;
+		}
+		if(field == -1 || (1ULL << (n + PT_PSB_PERIOD_SHIFT)) <= bytes) {
+			field = n;
+		}
+	}
+	return field;
+}
+
+uint64_t pt_config_build(const pt_config_opts_t* opts, uint64_t* psb_period) {
+	uint64_t config = 0;
+	if(!opts->ret_compression && !set_field(&config, "noretcomp", 1)) {
+		//kernels without format files use the same bit.
+		config |= PT_CONFIG_DEFAULT;
+	}
+	*psb_period = 1ULL << PT_PSB_PERIOD_SHIFT;
+	if(opts->psb_period != 0) {
+		int field = psb_period_field(opts->psb_period);
+		if(field < 0 || !set_field(&config, "psb_period", field)) {
+			std::cerr << "the PSB period is not configurable on this cpu, using " << *psb_period << " bytes." << std::endl;
+		}
+		else {
+			*psb_period = 1ULL << (field + PT_PSB_PERIOD_SHIFT);
+		}
+	}
+	return config;
+}
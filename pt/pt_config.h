@@ -0,0 +1,26 @@
+#ifndef _PT_CONFIG_H_
+#define _PT_CONFIG_H_
+
+#include <stdint.h>
+
+/* attr.config of the intel_pt event. The kernel publishes which bits mean
+   what in /sys/bus/event_source/devices/intel_pt/format (e.g. tsc is
+   "config:10", psb_period "config:24-27"), and what the cpu supports in
+   caps/. The config is built from zero, so timing packets (TSC, MTC, CYC),
+   power events and PTWRITE, which say nothing about coverage, stay off and
+   only branch packets and PSB+ are written. */
+
+//used when the format files cannot be read: no RET compression.
+#define PT_CONFIG_DEFAULT (1ULL << 11)
+
+typedef struct {
+	//bytes of trace between PSB+, 0 for the hardware default (2K).
+	uint64_t psb_period;
+	//let the cpu turn returns to their call site into a taken TNT bit.
+	bool ret_compression;
+} pt_config_opts_t;
+
+//config for the options, *psb_period is set to the PSB period it gives.
+uint64_t pt_config_build(const pt_config_opts_t* opts, uint64_t* psb_period);
+
+#endif
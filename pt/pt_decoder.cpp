@@ -4,6 +4,10 @@
 #include <linux/hw_breakpoint.h>
 #include <assert.h>
 #include "pt.h"
+#include "pt_parallel.h"
+#include "pt_scan.h"
+#include "pt_filter.h"
+#include "cofi_cache.h"
 
 #define ATOMIC_POST_OR_RELAXED(x, y) __atomic_fetch_or(&(x), y, __ATOMIC_RELAXED)
 #define ATOMIC_GET(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
@@ -62,6 +66,24 @@ pt_fuzzer::pt_fuzzer(std::string raw_binary_file, uint64_t base_address, uint64_
 #endif
 }
 
+//bytes, with a k/m suffix. 0 if it is not a size.
+static uint64_t parse_size(const char* value) {
+	char* end;
+	uint64_t size = strtoull(value, &end, 0);
+	if(end == value) {
+		return 0;
+	}
+	if(*end == 'k' || *end == 'K') {
+		size <<= 10;
+		end ++;
+	}
+	else if(*end == 'm' || *end == 'M') {
+		size <<= 20;
+		end ++;
+	}
+	return *end ? 0 : size;
+}
+
 bool pt_fuzzer::config_pt() {
 	uint8_t buf[PATH_MAX + 1];
 	ssize_t sz = files_readFileToBufMax("/sys/bus/event_source/devices/intel_pt/type", buf, sizeof(buf) - 1);
@@ -74,8 +96,22 @@ bool pt_fuzzer::config_pt() {
 
 	buf[sz] = '\0';
 	perfIntelPtPerfType = (int32_t)strtoul((char*)buf, NULL, 10);
+
+	pt_config_opts_t opts = {};
+	this->ret_compression = getenv("AFL_PT_RET_COMPRESSION") != nullptr && atoi(getenv("AFL_PT_RET_COMPRESSION")) != 0;
+	opts.ret_compression = this->ret_compression;
+	char* psb_period = getenv("AFL_PT_PSB_PERIOD");
+	if(psb_period != nullptr) {
+		opts.psb_period = parse_size(psb_period);
+		if(opts.psb_period == 0) {
+			std::cerr << "bad AFL_PT_PSB_PERIOD=" << psb_period << "." << std::endl;
+			return false;
+		}
+	}
+	this->pt_config = pt_config_build(&opts, &this->stats.psb_period);
+	this->stats.pt_config = this->pt_config;
 #ifdef DEBUG
-    std::cout << "config PT OK, perfIntelPtPerfType = " << perfIntelPtPerfType << std::endl;
+    std::cout << "config PT OK, perfIntelPtPerfType = " << perfIntelPtPerfType << ", config = 0x" << std::hex << this->pt_config << std::dec << std::endl;
 #endif
 	return true;
 }
@@ -102,10 +138,35 @@ bool pt_fuzzer::load_binary() {
 }
 
 bool pt_fuzzer::build_cofi_map() {
-	uint32_t num_inst = disassemble_binary( this->code, this->base_address, this->max_address, this->cofi_map);
+	uint32_t num_inst;
+	//the fuzzer is not bound to its cpu yet, the threads may run anywhere.
+	char* jobs = getenv("AFL_PT_DISASM_JOBS");
+	uint32_t num_threads = jobs != nullptr && atoi(jobs) > 1 ? atoi(jobs) : 1;
+	char* cache_dir = getenv("AFL_PT_COFI_CACHE");
+	char* lazy = getenv("AFL_PT_LAZY_DISASM");
+	if(lazy != nullptr && atoi(lazy) != 0) {
+		if(cache_dir != nullptr) {
+			std::cerr << "AFL_PT_COFI_CACHE is ignored with AFL_PT_LAZY_DISASM." << std::endl;
+		}
+		if(!this->cofi_map.init_lazy(this->code, this->base_address, this->max_address)) {
+			std::cerr << "set up lazy disassembly failed." << std::endl;
+			return false;
+		}
+		num_inst = 0;
+	}
+	else if(cache_dir != nullptr && *cache_dir) {
+		num_inst = disassemble_binary_cached(this->code, this->base_address, this->max_address, this->cofi_map, cache_dir, num_threads);
+		this->stats.cofi_cached = this->cofi_map.is_mapped();
+	}
+	else {
+		num_inst = disassemble_binary(this->code, this->base_address, this->max_address, this->cofi_map, num_threads);
+	}
 #ifdef DEBUG
-	std::cout << "total number of cofi instructions: " << num_inst << std::endl;
+	std::cout << "total number of cofi instructions: " << num_inst << ", basic blocks: " << this->cofi_map.num_blocks() << std::endl;
 #endif
+	this->run_cache = new tnt_run_cache(this->cofi_map, this->base_address, this->max_address, this->ret_compression);
+	this->decoder = new pt_packet_decoder(this->cofi_map, this->base_address, this->max_address, this->entry_point, this->run_cache);
+	this->decoder->set_ret_compression(this->ret_compression);
 	return true;
 }
 
@@ -133,22 +194,315 @@ void pt_fuzzer::init() {
 #ifdef DEBUG
     std::cout << "build cofi map OK." << std::endl;
 #endif
+
+	if(getenv("AFL_PT_CPU_MODE") != nullptr && atoi(getenv("AFL_PT_CPU_MODE")) != 0) {
+		//the filter is what would keep other processes out, and the kernel only takes file based filters on per-task events.
+		std::cerr << "AFL_PT_CPU_MODE is not supported: cpu-wide events take no address filter for user code, tracing per task." << std::endl;
+	}
+
+	char* aux = getenv("AFL_PT_AUX_SIZE");
+	if(aux != nullptr) {
+		if(strcmp(aux, "auto") == 0) {
+			this->auto_aux = true;
+		}
+		else {
+			//rounded up to a power of two as the kernel wants it.
+			uint64_t size = parse_size(aux);
+			if(size < (uint64_t)getpagesize()) {
+				std::cerr << "AFL_PT_AUX_SIZE=" << aux << " is too small." << std::endl;
+				exit(-1);
+			}
+			this->aux_size = getpagesize();
+			while(this->aux_size < size) {
+				this->aux_size <<= 1;
+			}
+		}
+	}
+
+	char* snapshot = getenv("AFL_PT_SNAPSHOT");
+	if(snapshot != nullptr) {
+		this->snapshot_size = parse_size(snapshot);
+		if(this->snapshot_size == 0 || this->snapshot_size > PT_AUX_MAX_SZ) {
+			std::cerr << "bad AFL_PT_SNAPSHOT=" << snapshot << "." << std::endl;
+			exit(-1);
+		}
+		//the window has to fit into the ring, and the ring size no longer depends on the trace length.
+		this->auto_aux = false;
+		while(this->aux_size < this->snapshot_size) {
+			this->aux_size <<= 1;
+		}
+		//a pooled ring would still hold the previous exec's trace.
+		this->tracer_pool_off = true;
+		this->stats.snapshot_size = this->snapshot_size;
+	}
+	this->stats.aux_size = this->aux_size;
+
+	char* dir = getenv("AFL_PT_CAPTURE_DIR");
+	if(dir != nullptr) {
+		this->capture_dir = dir;
+		char* max = getenv("AFL_PT_CAPTURE_MAX");
+		this->capture_max = max ? strtoul(max, nullptr, 0) : 1000;
+	}
+
+	char* decode_thread = getenv("AFL_PT_DECODE_THREAD");
+	if(decode_thread != nullptr && atoi(decode_thread) != 0) {
+		if(!this->capture_dir.empty()) {
+			//the thread frees the ring as it goes, nothing would be left to capture.
+			std::cerr << "AFL_PT_DECODE_THREAD is ignored with AFL_PT_CAPTURE_DIR." << std::endl;
+		}
+		else if(this->snapshot_size != 0) {
+			//where the window starts is only known once the trace has ended.
+			std::cerr << "AFL_PT_DECODE_THREAD is ignored with AFL_PT_SNAPSHOT." << std::endl;
+		}
+		else {
+			char* cpu = getenv("AFL_PT_DECODE_CPU");
+			this->decode_thread = new pt_decode_thread(cpu ? atoi(cpu) : -1);
+		}
+	}
+
+	char* jobs = getenv("AFL_PT_DECODE_JOBS");
+	if(jobs != nullptr && atoi(jobs) > 1 && this->decode_thread == nullptr) {
+		this->parallel_decoder = new pt_parallel_decoder(this->cofi_map, this->base_address, this->max_address, this->entry_point, atoi(jobs),
+				true, this->ret_compression);
+	}
+}
+
+uint8_t* pt_fuzzer::linear_aux(uint64_t tail, uint64_t head) {
+	uint8_t* aux = trace->get_perf_pt_aux();
+	uint64_t aux_size = trace->aux_size;
+	uint64_t offset = tail & (aux_size - 1);
+	uint64_t size = head - tail;
+	if(offset + size <= aux_size) {
+		return aux + offset;
+	}
+	this->linear_trace.resize(size);
+	memcpy(this->linear_trace.data(), aux + offset, aux_size - offset);
+	memcpy(this->linear_trace.data() + aux_size - offset, aux, size - (aux_size - offset));
+	return this->linear_trace.data();
+}
+
+void pt_fuzzer::decode_parallel(uint8_t* trace_bits) {
+	struct perf_event_mmap_page* pem = (struct perf_event_mmap_page*)trace->get_perf_pt_header();
+	uint64_t aux_size = pem->aux_size;
+	uint64_t head = ATOMIC_GET(pem->aux_head);
+	uint64_t tail = ATOMIC_GET(pem->aux_tail);
+	if(head - tail > aux_size) {
+		tail = head - aux_size;
+	}
+	//the segments need one contiguous trace.
+	this->parallel_decoder->decode(linear_aux(tail, head), head - tail);
+	ATOMIC_SET(pem->aux_tail, head);
+	this->stats.tnt_dropped += this->parallel_decoder->num_tnt_dropped;
+#ifdef DEBUG
+    std::cout << "decode finished, total number of decoded branch: " << this->parallel_decoder->num_decoded_branch << std::endl;
+#endif
+	memcpy(trace_bits, this->parallel_decoder->get_trace_bits(), MAP_SIZE);
+}
+
+void pt_fuzzer::snapshot_bounds(uint64_t* tail, uint64_t* head) {
+	//an overwritten ring does not move aux_tail, and the kernel may report aux_head as an offset into the ring.
+	//only the write position is used: whatever was not written before it since the ring was mapped reads as PAD.
+	uint64_t aux_size = trace->aux_size;
+	*head = (ATOMIC_GET(((struct perf_event_mmap_page*)trace->get_perf_pt_header())->aux_head) & (aux_size - 1)) + aux_size;
+	*tail = *head - std::min(this->snapshot_size, aux_size);
+}
+
+void pt_fuzzer::decode_snapshot(uint8_t* trace_bits) {
+	uint64_t tail, head;
+	snapshot_bounds(&tail, &head);
+	uint8_t* data = linear_aux(tail, head);
+	if(this->parallel_decoder != nullptr) {
+		this->parallel_decoder->decode(data, head - tail, true);
+		this->stats.tnt_dropped += this->parallel_decoder->num_tnt_dropped;
+		memcpy(trace_bits, this->parallel_decoder->get_trace_bits(), MAP_SIZE);
+		return;
+	}
+	//the window starts anywhere in a packet and long after the entry point, the decoder syncs on the first PSB.
+	this->decoder->reset(data, head - tail, trace_bits == this->out_bits ? trace_bits : nullptr);
+	this->decoder->start_mid_trace();
+	this->decoder->decode();
+	this->stats.tnt_dropped += this->decoder->num_tnt_dropped;
+	if(this->decoder->get_trace_bits() != trace_bits) {
+		memcpy(trace_bits, this->decoder->get_trace_bits(), MAP_SIZE);
+	}
+}
+
+void pt_fuzzer::capture_trace() {
+	if(this->capture_count >= this->capture_max) {
+		return;
+	}
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/trace_%06u.pt", this->capture_dir.c_str(), this->capture_count);
+
+	struct perf_event_mmap_page* pem = (struct perf_event_mmap_page*)trace->get_perf_pt_header();
+	pt_trace_header_t header;
+	memset(&header, 0, sizeof(header));
+	if(this->snapshot_size != 0) {
+		snapshot_bounds(&header.aux_tail, &header.aux_head);
+	}
+	else {
+		header.aux_head = ATOMIC_GET(pem->aux_head);
+		header.aux_tail = ATOMIC_GET(pem->aux_tail);
+	}
+	header.min_address = this->base_address;
+	header.max_address = this->max_address;
+	header.entry_point = this->entry_point;
+	if(pt_trace_write(path, &header, trace->get_perf_pt_aux(), trace->aux_size)) {
+		this->capture_count ++;
+	}
+}
+
+void pt_fuzzer::open_tracer_pool() {
+	//done on the first exec, AFL binds itself to a cpu after init_pt_fuzzer().
+	this->tracer_pool_off = true;
+	if(getenv("AFL_PT_NO_POOL") != nullptr) {
+		return;
+	}
+	cpu_set_t set;
+	if(sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) != 1) {
+		return;
+	}
+	int cpu = 0;
+	while(!CPU_ISSET(cpu, &set)) {
+		cpu ++;
+	}
+	this->tracer_pool = new pt_tracer_pool(cpu);
+	uint32_t aux_watermark = this->decode_thread ? this->aux_size / 4 : 0;
+	if(!this->tracer_pool->open(perfIntelPtPerfType, this->pt_config, aux_watermark, this->aux_size)) {
+		std::cerr << "tracer pool not available, mapping the trace buffers per exec." << std::endl;
+		delete this->tracer_pool;
+		this->tracer_pool = nullptr;
+		return;
+	}
+	this->tracer_pool_off = false;
+	this->stats.tracer_pool = 1;
+}
+
+void pt_fuzzer::set_target(const char* path) {
+	if(getenv("AFL_PT_NO_FILTER") != nullptr) {
+		return;
+	}
+	uint32_t max_ranges = pt_filter_num_ranges();
+	if(max_ranges == 0) {
+		std::cerr << "PT address filters are not supported, tracing all user mode code." << std::endl;
+		return;
+	}
+	std::vector<pt_addr_range_t> ranges;
+	char* spec = getenv("AFL_PT_FILTER");
+	if(spec != nullptr) {
+		if(!pt_filter_parse_ranges(spec, ranges)) {
+			std::cerr << "AFL_PT_FILTER=" << spec << " is not a list of start-end ranges." << std::endl;
+			exit(-1);
+		}
+	}
+	else {
+		ranges.push_back({this->base_address, this->max_address});
+	}
+	uint32_t num_ranges;
+	this->filter = pt_filter_build(path, ranges, max_ranges, &num_ranges);
+	if(this->filter.empty()) {
+		std::cerr << "no code of " << path << " to filter on, tracing all user mode code." << std::endl;
+		return;
+	}
+	this->stats.filter_ranges = num_ranges;
+#ifdef DEBUG
+	std::cout << "PT address filter: " << this->filter << std::endl;
+#endif
+}
+
+uint64_t pt_fuzzer::tune_aux_size() {
+	if(this->auto_aux && this->max_trace_volume != 0) {
+		//twice the largest trace leaves room for inputs that run a bit longer.
+		uint64_t size = PT_AUX_MIN_SZ;
+		while(size < this->max_trace_volume * 2 && size < PT_AUX_MAX_SZ) {
+			size <<= 1;
+		}
+		this->aux_size = size;
+		this->stats.aux_size = size;
+	}
+	return this->aux_size;
+}
+
+void pt_fuzzer::resume_trace() {
+	this->trace->reset();
+	this->aux_start = ATOMIC_GET(((struct perf_event_mmap_page*)trace->get_perf_pt_header())->aux_head);
+	if(this->decode_thread != nullptr) {
+		this->decoder->reset(trace->get_perf_pt_header(), trace->get_perf_pt_aux(), this->out_bits);
+		this->decode_thread->attach(this->decoder);
+	}
+	if(!trace->start_trace()){
+		std::cerr << "start PT event failed." << std::endl;
+		exit(-1);
+	}
 }
 
 void pt_fuzzer::start_pt_trace(int pid) {
+	auto setup_start = std::chrono::steady_clock::now();
+	if(this->trace != nullptr) {
+		if(this->trace->get_pid() == pid) {
+			//next persistent mode iteration of the same child.
+			resume_trace();
+			this->stats.setup_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - setup_start).count();
+			return;
+		}
+		//the stopped child was killed instead.
+		this->trace->close_pt();
+		delete this->trace;
+		this->trace = nullptr;
+	}
+	if(this->tracer_pool != nullptr && this->tracer_pool->get_aux_size() != this->aux_size) {
+		//resized, map a new ring.
+		delete this->tracer_pool;
+		this->tracer_pool = nullptr;
+		this->tracer_pool_off = false;
+	}
+	if(this->tracer_pool == nullptr && !this->tracer_pool_off) {
+		open_tracer_pool();
+	}
 	this->trace = new pt_tracer(pid);
-	if(!trace->open_pt(perfIntelPtPerfType)){
+	this->trace->aux_size = this->aux_size;
+	if(this->decode_thread != nullptr) {
+		//wake the decoder thread every quarter ring instead of once it is half full.
+		this->trace->aux_watermark = this->aux_size / 4;
+	}
+	this->trace->enable_on_exec = !this->fork_server;
+	this->trace->snapshot = this->snapshot_size != 0;
+	this->trace->config = this->pt_config;
+	if(this->tracer_pool != nullptr) {
+		this->tracer_pool->reset();
+		if(!trace->open_pt(perfIntelPtPerfType, this->tracer_pool)) {
+			std::cerr << "tracer pool not usable, mapping the trace buffers per exec." << std::endl;
+			delete this->tracer_pool;
+			this->tracer_pool = nullptr;
+			this->tracer_pool_off = true;
+			this->stats.tracer_pool = 0;
+		}
+	}
+	if(this->tracer_pool == nullptr && !trace->open_pt(perfIntelPtPerfType)){
 		std::cerr << "open PT event failed." << std::endl;
 		exit(-1);
 	}
+	if(!this->filter.empty() && !trace->set_filter(this->filter.c_str())) {
+		//e.g. an older kernel, or the ranges do not fit after all.
+		std::cerr << "PT address filter rejected, tracing all user mode code." << std::endl;
+		this->filter.clear();
+		this->stats.filter_ranges = 0;
+	}
+	this->aux_start = ATOMIC_GET(((struct perf_event_mmap_page*)trace->get_perf_pt_header())->aux_head);
+	this->stats.setup_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - setup_start).count();
 #ifdef DEBUG
     std::cout << "open PT event OK." << std::endl;
 #endif
+	if(this->decode_thread != nullptr) {
+		this->decoder->reset(trace->get_perf_pt_header(), trace->get_perf_pt_aux(), this->out_bits);
+		this->decode_thread->attach(this->decoder);
+	}
 
-	// if(!trace->start_trace()){
-	// 	std::cerr << "start PT event failed." << std::endl;
-	// 	exit(-1);
-	// }
+	//the child is held by the fork server until this returns, so nothing before the entry point runs traced.
+	if(this->fork_server && !trace->start_trace()){
+		std::cerr << "start PT event failed." << std::endl;
+		exit(-1);
+	}
 #ifdef DEBUG
 	std::cout << "after start_trace" << std::endl;
 #endif
@@ -159,7 +513,18 @@ void pt_fuzzer::start_pt_trace(int pid) {
 #endif
 }
 
-void pt_fuzzer::stop_pt_trace(uint8_t *trace_bits) {
+void pt_fuzzer::finish_exec(bool keep_tracer) {
+	auto setup_start = std::chrono::steady_clock::now();
+	if(!keep_tracer) {
+		this->trace->close_pt();
+		delete this->trace;
+		this->trace = nullptr;
+	}
+	this->stats.setup_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - setup_start).count();
+	this->stats.execs ++;
+}
+
+void pt_fuzzer::stop_pt_trace(uint8_t *trace_bits, bool keep_tracer) {
 	if(!this->trace->stop_trace()){
 		std::cerr << "stop PT event failed." << std::endl;
 		exit(-1);
@@ -167,20 +532,59 @@ void pt_fuzzer::stop_pt_trace(uint8_t *trace_bits) {
 #ifdef DEBUG
 	std::cout << "stop pt trace OK." << std::endl;
 #endif
-	pt_packet_decoder decoder(trace->get_perf_pt_header(), trace->get_perf_pt_aux(), this->cofi_map, this->base_address, this->max_address, this->entry_point);
-	decoder.decode();
+	if(this->snapshot_size != 0) {
+		//disabling the event froze the ring. A kept tracer would go on writing into the same ring,
+		//so a persistent mode child gets a new event (and ring) for every iteration.
+		if(!this->capture_dir.empty()) {
+			capture_trace();
+		}
+		auto decode_start = std::chrono::steady_clock::now();
+		decode_snapshot(trace_bits);
+		this->stats.decode_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - decode_start).count();
+		finish_exec(false);
+		return;
+	}
+	uint64_t volume = ATOMIC_GET(((struct perf_event_mmap_page*)trace->get_perf_pt_header())->aux_head) - this->aux_start;
+	this->max_trace_volume = std::max(this->max_trace_volume, volume);
+	if(this->trace->count_truncated() != 0) {
+		//the kernel stopped tracing when the ring was full, the rest of the run is missing.
+		this->stats.overflows ++;
+		if(this->auto_aux && this->aux_size < PT_AUX_MAX_SZ) {
+			this->aux_size <<= 1;
+			this->stats.aux_size = this->aux_size;
+		}
+	}
+	if(!this->capture_dir.empty()) {
+		capture_trace();
+	}
+	auto decode_start = std::chrono::steady_clock::now();
+	if(this->parallel_decoder != nullptr) {
+		decode_parallel(trace_bits);
+		this->stats.decode_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - decode_start).count();
+		finish_exec(keep_tracer);
+		return;
+	}
+	pt_packet_decoder* decoder = this->decoder;
+	if(this->decode_thread != nullptr) {
+		//most of the trace is decoded already, the rest is drained below.
+		this->decode_thread->detach();
+	}
+	else {
+		decoder->reset(trace->get_perf_pt_header(), trace->get_perf_pt_aux(), trace_bits == this->out_bits ? trace_bits : nullptr);
+	}
+	decoder->decode();
+	this->stats.tnt_dropped += decoder->num_tnt_dropped;
 #ifdef DEBUG
-    std::cout << "decode finished, total number of decoded branch: " << decoder.num_decoded_branch << std::endl;
+    std::cout << "decode finished, total number of decoded branch: " << decoder->num_decoded_branch << std::endl;
 #endif
-	this->trace->close_pt();
-	delete this->trace;
-	this->trace = nullptr;
-	memcpy(trace_bits, decoder.get_trace_bits(), MAP_SIZE);
+	if(decoder->get_trace_bits() != trace_bits) {
+		memcpy(trace_bits, decoder->get_trace_bits(), MAP_SIZE);
+	}
+	this->stats.decode_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - decode_start).count();
+	finish_exec(keep_tracer);
 }
 
-bool pt_tracer::open_pt(int pt_perf_type) {
-
-	int pid = this->trace_pid;
+static int open_pt_event(int pt_perf_type, uint64_t config, int pid, int cpu, uint32_t aux_watermark, bool enable_on_exec) {
     struct perf_event_attr pe;
     memset(&pe, 0, sizeof(struct perf_event_attr));
     pe.size = sizeof(struct perf_event_attr);
@@ -193,42 +597,35 @@ bool pt_tracer::open_pt(int pt_perf_type) {
     //默认关闭，下一个exec()打开
     ///////////////
     pe.disabled = 1;
-    pe.enable_on_exec = 1;
+    pe.enable_on_exec = enable_on_exec;
     //pe.type = PERF_TYPE_HARDWARE;
     pe.type = pt_perf_type;
 #ifdef DEBUG
     std::cout << "pe.type = " << pe.type << std::endl;
 #endif
-    pe.config = (1U << 11); /* Disable RETCompression */
+    pe.config = config; /* see pt_config.h */
+    pe.aux_watermark = aux_watermark;
 #if !defined(PERF_FLAG_FD_CLOEXEC)
 #define PERF_FLAG_FD_CLOEXEC 0
 #endif
-    perf_fd = perf_event_open(&pe, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
-    if (perf_fd == -1) {
+    int fd = perf_event_open(&pe, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd == -1) {
         printf("perf_event_open() failed\n");
-        return false;
     }
-#ifdef DEBUG
-    std::cout << "before wrmsr" << std::endl;
-#endif
-    //char* reg_value[2] = {"0x100002908", nullptr};
-    //rdmsr_on_all_cpus(0x570);
-    //wrmsr_on_all_cpus(0x570, 1, reg_value);
-#ifdef DEBUG
-    std::cout << "after wrmsr" << std::endl;
-#endif
-    //rdmsr_on_all_cpus(0x570);
+    return fd;
+}
+
+static bool map_pt_buffers(int perf_fd, uint64_t aux_size, bool overwrite, uint8_t** perf_pt_header, uint8_t** perf_pt_aux) {
 //#if defined(PERF_ATTR_SIZE_VER5)
-    this->perf_pt_header =
+    *perf_pt_header =
         (uint8_t*)mmap(NULL, _HF_PERF_MAP_SZ + getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED, perf_fd, 0);
-    if (this->perf_pt_header == MAP_FAILED) {
+    if (*perf_pt_header == MAP_FAILED) {
 		perror("ERROR: ");
-		this->perf_pt_header = nullptr;
+		*perf_pt_header = nullptr;
         printf(
             "mmap(mmapBuf) failed, sz=%zu, try increasing the kernel.perf_event_mlock_kb sysctl "
             "(up to even 300000000)\n",
             (size_t)_HF_PERF_MAP_SZ + getpagesize());
-        close(perf_fd);
         return false;
     }
 	//~ To set up an AUX area, first aux_offset needs to be set with
@@ -236,25 +633,47 @@ bool pt_tracer::open_pt(int pt_perf_type) {
     //~ needs to be set to the desired buffer size.  The desired off‐
     //~ set and size must be page aligned, and the size must be a
     //~ power of two.
-    struct perf_event_mmap_page* pem = (struct perf_event_mmap_page*)this->perf_pt_header;
+    struct perf_event_mmap_page* pem = (struct perf_event_mmap_page*)*perf_pt_header;
     pem->aux_offset = pem->data_offset + pem->data_size;
-    pem->aux_size = _HF_PERF_AUX_SZ;
-    this->perf_pt_aux =
-        (uint8_t*)mmap(NULL, pem->aux_size, PROT_READ | PROT_WRITE, MAP_SHARED, perf_fd, pem->aux_offset);
-    if (this->perf_pt_aux == MAP_FAILED) {
-        munmap(this->perf_pt_aux, _HF_PERF_MAP_SZ + getpagesize());
-        this->perf_pt_aux = NULL;
+    pem->aux_size = aux_size;
+    //without PROT_WRITE the aux ring is in overwrite (snapshot) mode.
+    *perf_pt_aux =
+        (uint8_t*)mmap(NULL, pem->aux_size, overwrite ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, perf_fd, pem->aux_offset);
+    if (*perf_pt_aux == MAP_FAILED) {
+        munmap(*perf_pt_header, _HF_PERF_MAP_SZ + getpagesize());
+        *perf_pt_header = nullptr;
+        *perf_pt_aux = nullptr;
         perror("ERROR: ");
         printf(
             "mmap(mmapAuxBuf) failed, try increasing the kernel.perf_event_mlock_kb sysctl (up to "
             "even 300000000)\n");
-        close(perf_fd);
         return false;
     }
 //#else  /* defined(PERF_ATTR_SIZE_VER5) */
     //~ LOG_F("Your <linux_t/perf_event.h> includes are too old to support Intel PT/BTS");
 //#endif /* defined(PERF_ATTR_SIZE_VER5) */
+    return true;
+}
 
+bool pt_tracer::open_pt(int pt_perf_type) {
+    perf_fd = open_pt_event(pt_perf_type, this->config, this->trace_pid, -1, this->aux_watermark, this->enable_on_exec);
+    if (perf_fd == -1) {
+        return false;
+    }
+#ifdef DEBUG
+    std::cout << "before wrmsr" << std::endl;
+#endif
+    //char* reg_value[2] = {"0x100002908", nullptr};
+    //rdmsr_on_all_cpus(0x570);
+    //wrmsr_on_all_cpus(0x570, 1, reg_value);
+#ifdef DEBUG
+    std::cout << "after wrmsr" << std::endl;
+#endif
+    //rdmsr_on_all_cpus(0x570);
+    if (!map_pt_buffers(perf_fd, this->aux_size, this->snapshot, &this->perf_pt_header, &this->perf_pt_aux)) {
+        close(perf_fd);
+        return false;
+    }
 #ifdef DEBUG
 	std::cout << "after mmap" << std::endl;
 #endif
@@ -262,14 +681,118 @@ bool pt_tracer::open_pt(int pt_perf_type) {
     return true;
 }
 
+bool pt_tracer::open_pt(int pt_perf_type, pt_tracer_pool* pool) {
+    perf_fd = open_pt_event(pt_perf_type, this->config, this->trace_pid, pool->get_cpu(), this->aux_watermark, this->enable_on_exec);
+    if (perf_fd == -1) {
+        return false;
+    }
+    if (ioctl(perf_fd, PERF_EVENT_IOC_SET_OUTPUT, pool->get_fd()) < 0) {
+        perror("ERROR: ");
+        std::cerr << "redirecting the PT event to the tracer pool failed." << std::endl;
+        close(perf_fd);
+        return false;
+    }
+    this->pool = pool;
+    this->aux_size = pool->get_aux_size();
+    this->perf_pt_header = pool->get_perf_pt_header();
+    this->perf_pt_aux = pool->get_perf_pt_aux();
+    return true;
+}
+
 void pt_tracer::close_pt() {
-	munmap(this->perf_pt_aux, _HF_PERF_AUX_SZ);
+	if(this->pool == nullptr) {
+		munmap(this->perf_pt_aux, this->aux_size);
+		munmap(this->perf_pt_header, _HF_PERF_MAP_SZ + getpagesize());
+	}
 	this->perf_pt_aux = NULL;
-	munmap(this->perf_pt_header, _HF_PERF_MAP_SZ + getpagesize());
 	this->perf_pt_header = NULL;
 	close(perf_fd);
 }
 
+pt_tracer_pool::pt_tracer_pool(int cpu) : cpu(cpu) {
+
+}
+
+pt_tracer_pool::~pt_tracer_pool() {
+	if(this->perf_pt_header != nullptr) {
+		munmap(this->perf_pt_aux, this->aux_size);
+		munmap(this->perf_pt_header, _HF_PERF_MAP_SZ + getpagesize());
+	}
+	if(this->holder_fd != -1) {
+		close(this->holder_fd);
+	}
+}
+
+bool pt_tracer_pool::open(int pt_perf_type, uint64_t config, uint32_t aux_watermark, uint64_t aux_size) {
+	this->aux_size = aux_size;
+	//bound to ourselves and never enabled, it only owns the ring.
+	this->holder_fd = open_pt_event(pt_perf_type, config, 0, this->cpu, aux_watermark, false);
+	if(this->holder_fd == -1) {
+		return false;
+	}
+	if(!map_pt_buffers(this->holder_fd, aux_size, false, &this->perf_pt_header, &this->perf_pt_aux)) {
+		close(this->holder_fd);
+		this->holder_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+bool pt_tracer::set_filter(const char* filter) {
+	if(ioctl(perf_fd, PERF_EVENT_IOC_SET_FILTER, filter) < 0) {
+		perror("PERF_EVENT_IOC_SET_FILTER");
+		return false;
+	}
+	return true;
+}
+
+uint32_t pt_tracer::count_truncated() {
+	struct perf_event_mmap_page* pem = (struct perf_event_mmap_page*)this->perf_pt_header;
+	uint8_t* data = this->perf_pt_header + pem->data_offset;
+	uint64_t data_size = pem->data_size;
+	uint64_t head = ATOMIC_GET(pem->data_head);
+	uint64_t tail = pem->data_tail;
+	uint32_t truncated = 0;
+	while(tail + sizeof(struct perf_event_header) <= head) {
+		//records may wrap around the end of the ring.
+		uint8_t record[sizeof(struct perf_event_header) + 3 * sizeof(uint64_t)];
+		uint64_t len = std::min((uint64_t)sizeof(record), head - tail);
+		for(uint64_t i = 0; i < len; i ++) {
+			record[i] = data[(tail + i) & (data_size - 1)];
+		}
+		struct perf_event_header* hdr = (struct perf_event_header*)record;
+		if(hdr->size == 0) {
+			break;
+		}
+		if(hdr->type == PERF_RECORD_AUX && len == sizeof(record)) {
+			//aux_offset, aux_size, flags
+			uint64_t flags = ((uint64_t*)(hdr + 1))[2];
+			if(flags & PERF_AUX_FLAG_TRUNCATED) {
+				truncated ++;
+			}
+		}
+		else if(hdr->type == PERF_RECORD_LOST) {
+			truncated ++;
+		}
+		tail += hdr->size;
+	}
+	ATOMIC_SET(pem->data_tail, head);
+	return truncated;
+}
+
+void pt_tracer::reset() {
+	struct perf_event_mmap_page* pem = (struct perf_event_mmap_page*)this->perf_pt_header;
+	ATOMIC_SET(pem->aux_tail, ATOMIC_GET(pem->aux_head));
+	ATOMIC_SET(pem->data_tail, ATOMIC_GET(pem->data_head));
+}
+
+void pt_tracer_pool::reset() {
+	struct perf_event_mmap_page* pem = (struct perf_event_mmap_page*)this->perf_pt_header;
+	//drop what nobody read, the sideband records in the data area are never looked at.
+	ATOMIC_SET(pem->aux_tail, ATOMIC_GET(pem->aux_head));
+	ATOMIC_SET(pem->data_tail, ATOMIC_GET(pem->data_head));
+}
+
 pt_tracer::pt_tracer(int pid) : trace_pid(pid), perf_pt_header(nullptr), perf_pt_aux(nullptr) {
 
 }
@@ -295,22 +818,51 @@ bool pt_tracer::stop_trace(){
 }
 
 
-pt_packet_decoder::pt_packet_decoder(uint8_t* perf_pt_header, uint8_t* perf_pt_aux, cofi_map_t& map,
-		uint64_t min_address, uint64_t max_address, uint64_t entry_point) :
-		pt_packets(perf_pt_aux), cofi_map(map), min_address(min_address), max_address(max_address), app_entry_point(entry_point){
+//the block graph walks like the cofi map as long as all of the map is in bounds.
+static bool blocks_usable(const cofi_map_t& map, uint64_t min_address, uint64_t max_address) {
+	return map.num_blocks() != 0 && min_address <= map.get_base_address() && max_address + 1 >= map.get_base_address() + map.get_code_size();
+}
+
+pt_packet_decoder::pt_packet_decoder(uint8_t* perf_pt_header, uint8_t* perf_pt_aux, const cofi_map_t& map,
+		uint64_t min_address, uint64_t max_address, uint64_t entry_point, tnt_run_cache* run_cache) :
+		min_address(min_address), max_address(max_address), app_entry_point(entry_point), pt_packets(perf_pt_aux), cofi_map(map), run_cache(run_cache){
 	struct perf_event_mmap_page* pem = (struct perf_event_mmap_page*)perf_pt_header;
+	this->perf_pt_header = perf_pt_header;
 	aux_tail = ATOMIC_GET(pem->aux_tail);
 	aux_head = ATOMIC_GET(pem->aux_head);
+	trace_size = aux_head > aux_tail ? aux_head - aux_tail : 0;
 	trace_bits = (uint8_t*)malloc(MAP_SIZE * sizeof(uint8_t));
+	own_trace_bits = true;
 	memset(trace_bits, 0, MAP_SIZE);
     tnt_cache_state = tnt_cache_init();
+	use_blocks = blocks_usable(map, min_address, max_address);
 #ifdef DEBUG
     std::cout << "app_entry_point = " << app_entry_point << std::endl;
 #endif
 }
 
+pt_packet_decoder::pt_packet_decoder(uint8_t* trace, uint64_t trace_size, const cofi_map_t& map,
+		uint64_t min_address, uint64_t max_address, uint64_t entry_point, tnt_run_cache* run_cache) :
+		min_address(min_address), max_address(max_address), app_entry_point(entry_point), pt_packets(trace), trace_size(trace_size), cofi_map(map), run_cache(run_cache){
+	aux_tail = 0;
+	aux_head = trace_size;
+	trace_bits = (uint8_t*)malloc(MAP_SIZE * sizeof(uint8_t));
+	own_trace_bits = true;
+	memset(trace_bits, 0, MAP_SIZE);
+    tnt_cache_state = tnt_cache_init();
+	use_blocks = blocks_usable(map, min_address, max_address);
+}
+
+pt_packet_decoder::pt_packet_decoder(const cofi_map_t& map, uint64_t min_address, uint64_t max_address, uint64_t entry_point, tnt_run_cache* run_cache) :
+		min_address(min_address), max_address(max_address), app_entry_point(entry_point), pt_packets(nullptr), trace_size(0), cofi_map(map), run_cache(run_cache){
+	aux_tail = 0;
+	aux_head = 0;
+    tnt_cache_state = tnt_cache_init();
+	use_blocks = blocks_usable(map, min_address, max_address);
+}
+
 pt_packet_decoder::~pt_packet_decoder() {
-	if(trace_bits != nullptr) {
+	if(own_trace_bits) {
 		free(trace_bits);
 	}
     if(tnt_cache_state != nullptr){
@@ -318,6 +870,59 @@ pt_packet_decoder::~pt_packet_decoder() {
     }
 }
 
+void pt_packet_decoder::reset_state(uint8_t* trace_bits) {
+	this->walk_cofi = nullptr;
+	this->walk_at_tip = false;
+	this->walk_edge_ip = 0;
+	this->wait_psb = false;
+	this->last_ip2 = 0;
+	this->start_decode = false;
+	this->fup_pkt = false;
+	this->isr = false;
+	this->in_range = false;
+	this->pge_enabled = false;
+	this->synced = false;
+	this->carry_len = 0;
+	this->bitmap_last_ip = 0;
+	this->first_edge_addr = 0;
+	this->num_decoded_branch = 0;
+	this->num_tnt_dropped = 0;
+	this->ret_depth = 0;
+	tnt_cache_reset(this->tnt_cache_state);
+	if(trace_bits != nullptr) {
+		if(this->own_trace_bits) {
+			free(this->trace_bits);
+			this->own_trace_bits = false;
+		}
+		this->trace_bits = trace_bits;
+		return;
+	}
+	if(!this->own_trace_bits) {
+		this->trace_bits = (uint8_t*)malloc(MAP_SIZE * sizeof(uint8_t));
+		this->own_trace_bits = true;
+	}
+	memset(this->trace_bits, 0, MAP_SIZE);
+}
+
+void pt_packet_decoder::reset(uint8_t* perf_pt_header, uint8_t* perf_pt_aux, uint8_t* trace_bits) {
+	struct perf_event_mmap_page* pem = (struct perf_event_mmap_page*)perf_pt_header;
+	this->perf_pt_header = perf_pt_header;
+	this->pt_packets = perf_pt_aux;
+	this->aux_tail = ATOMIC_GET(pem->aux_tail);
+	this->aux_head = ATOMIC_GET(pem->aux_head);
+	this->trace_size = this->aux_head > this->aux_tail ? this->aux_head - this->aux_tail : 0;
+	reset_state(trace_bits);
+}
+
+void pt_packet_decoder::reset(uint8_t* trace, uint64_t trace_size, uint8_t* trace_bits) {
+	this->perf_pt_header = nullptr;
+	this->pt_packets = trace;
+	this->trace_size = trace_size;
+	this->aux_tail = 0;
+	this->aux_head = trace_size;
+	reset_state(trace_bits);
+}
+
 void pt_packet_decoder::print_tnt(tnt_cache_t* tnt_cache){
     uint32_t count = count_tnt(tnt_cache);
 #ifdef DEBUG
@@ -346,40 +951,43 @@ void pt_packet_decoder::print_tnt(tnt_cache_t* tnt_cache){
 #endif
 }
 
-uint32_t pt_packet_decoder::decode_tnt(uint64_t entry_point){
-	uint8_t tnt;
-	uint32_t num_tnt_decoded = 0;
-	cofi_inst_t* cofi_obj = nullptr;
-#ifdef DEBUG
-    std::cout << "call in decode_tnt" << std::endl;
-#endif
-	
-	if(!start_decode){
-#ifdef DEBUG
-		std::cout << "not start_decode, return." << std::endl;
-#endif
-		return 0;
+void pt_packet_decoder::follow_ip(uint64_t ip){
+	this->walk_cofi = nullptr;
+	this->walk_at_tip = false;
+	this->walk_edge_ip = 0;
+	if(this->wait_psb || out_of_bounds(ip)){
+		return;
 	}
-	//if(count_tnt(tnt_cache_state) == 0){
-#ifdef DEBUG
-	//	std::cout << "tnt cache is empty, return." << std::endl;
-#endif
-	//	return 0;
-	//}
-
 #ifdef DEBUG
-	std::cout << "calling decode_tnt for entry_point: " << std::hex << entry_point << std::endl;
+	std::cout << "walk continues at: " << std::hex << ip << std::endl;
 #endif
-	cofi_obj = this->cofi_map[entry_point];
+	const cofi_inst_t* cofi_obj = this->cofi_map[ip];
 	if(cofi_obj == nullptr){
-		std::cerr << "can not find cofi for entry_point: " << std::hex << "0x" << entry_point << std::endl;
+		std::cerr << "can not find cofi for entry_point: " << std::hex << "0x" << ip << std::endl;
 		std::cerr << "number of decoded branches: " << num_decoded_branch << std::endl;
-		return 0;
+		return;
 	}
-	alter_bitmap(entry_point);
+	this->walk_cofi = cofi_obj;
+	this->walk_edge_ip = ip;
+}
+
+uint32_t pt_packet_decoder::decode_tnt(){
+	uint8_t tnt;
+	uint32_t num_tnt_decoded = 0;
+	const cofi_inst_t* cofi_obj = this->walk_cofi;
 #ifdef DEBUG
-    std::cout << "decode_tnt: before while, start_decode = " << this->start_decode << std::endl; 
+    std::cout << "call in decode_tnt" << std::endl;
 #endif
+	if(cofi_obj == nullptr || this->walk_at_tip){
+		return 0;
+	}
+	if(this->walk_edge_ip != 0){
+		if(this->first_edge_addr == 0) {
+			this->first_edge_addr = this->walk_edge_ip;
+		}
+		alter_bitmap(this->walk_edge_ip);
+		this->walk_edge_ip = 0;
+	}
 	while(true) {
 		if(cofi_obj == nullptr){
 #ifdef DEBUG
@@ -387,6 +995,37 @@ uint32_t pt_packet_decoder::decode_tnt(uint64_t entry_point){
 #endif
 		    break;
 		}
+		if(run_cache && cofi_obj->type == COFI_TYPE_CONDITIONAL_BRANCH){
+			uint64_t bits;
+			uint32_t count = peek_tnt_cache(tnt_cache_state, TNT_RUN_MAX_BITS, &bits);
+			if(count == 0){
+				this->walk_cofi = cofi_obj;
+				return num_tnt_decoded;
+			}
+			const tnt_run_t* run = run_cache->lookup(cofi_obj, count, bits);
+			if(run->consumed){
+				drop_tnt_cache(tnt_cache_state, run->consumed);
+				trace_bits[(uint16_t)bitmap_last_ip ^ run->first_addr]++;
+				const uint16_t* edges = run_cache->get_edges(run);
+				for(uint16_t i = 0; i < run->num_edges; i ++){
+					trace_bits[edges[i]]++;
+				}
+				bitmap_last_ip = run->last_ip;
+				num_tnt_decoded += run->num_branches;
+				this->num_decoded_branch += run->num_branches;
+				cofi_obj = run->next;
+				continue;
+			}
+		}
+		if(use_blocks && cofi_obj->type == COFI_TYPE_CONDITIONAL_BRANCH){
+			cofi_obj = walk_blocks(cofi_obj, &num_tnt_decoded);
+			if(cofi_obj != nullptr && cofi_obj->type == COFI_TYPE_CONDITIONAL_BRANCH){
+				//out of TNT.
+				this->walk_cofi = cofi_obj;
+				return num_tnt_decoded;
+			}
+			continue;
+		}
 		switch(cofi_obj->type){
 
 			case COFI_TYPE_CONDITIONAL_BRANCH:
@@ -400,6 +1039,7 @@ uint32_t pt_packet_decoder::decode_tnt(uint64_t entry_point){
 #ifdef DEBUG
 		            std::cerr << "warning: case TNT_EMPTY." << std::endl;
 #endif
+					this->walk_cofi = cofi_obj;
 					return num_tnt_decoded;
 				case TAKEN:
 		        {
@@ -411,6 +1051,7 @@ uint32_t pt_packet_decoder::decode_tnt(uint64_t entry_point){
 		            uint64_t target_addr = cofi_obj->target_addr;
 					if (out_of_bounds(target_addr)){
 		                std::cerr << "error: tnt target out of bounds, inst address = " << std::hex << cofi_obj->inst_addr << ", target = " << target_addr << std::endl;
+						this->walk_cofi = nullptr;
 						return num_tnt_decoded;
 		            }
 		            alter_bitmap(target_addr);
@@ -421,10 +1062,10 @@ uint32_t pt_packet_decoder::decode_tnt(uint64_t entry_point){
 				case NOT_TAKEN:
 					//~ sample_decoded_detailed("(%d)\t%lx\t(Not Taken)\n", COFI_TYPE_CONDITIONAL_BRANCH ,obj->cofi->ins_addr);
 #ifdef DEBUG
-		            std::cout << "inst " << cofi_obj->inst_addr << " NOT_TAKEN, next = " << cofi_obj->next_cofi->inst_addr << std::endl;
+		            std::cout << "inst " << cofi_obj->inst_addr << " NOT_TAKEN, next = " << cofi_map.next(cofi_obj)->inst_addr << std::endl;
 #endif
-					alter_bitmap(cofi_obj->next_cofi->inst_addr);
-					cofi_obj = cofi_obj->next_cofi;
+					cofi_obj = cofi_map.next(cofi_obj);
+					alter_bitmap(cofi_obj->inst_addr);
 
 					break;
 				}
@@ -434,6 +1075,9 @@ uint32_t pt_packet_decoder::decode_tnt(uint64_t entry_point){
 				std::cout << "COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH: " << std::hex << cofi_obj->inst_addr << ", target = " << cofi_obj->target_addr << std::endl;
 #endif
 				uint64_t target_addr = cofi_obj->target_addr;
+				if(this->ret_compression && cofi_obj->is_call) {
+					push_ret(cofi_obj);
+				}
 				alter_bitmap(target_addr);
 				cofi_obj = cofi_map[target_addr];
 				break;
@@ -443,14 +1087,37 @@ uint32_t pt_packet_decoder::decode_tnt(uint64_t entry_point){
 				std::cout << "COFI_TYPE_INDIRECT_BRANCH: " << std::hex << cofi_obj->inst_addr << ", target = " << cofi_obj->target_addr << std::endl;
 #endif
 				//assert(false); //not implemented.
-				cofi_obj = nullptr;
+				if(this->ret_compression && cofi_obj->is_call) {
+					push_ret(cofi_obj);
+				}
+				//wait here for the TIP with the target.
+				this->walk_at_tip = true;
 				break;
 
 			case COFI_TYPE_NEAR_RET:
 #ifdef DEBUG
 				std::cout << "COFI_TYPE_NEAR_RET: " << std::hex << cofi_obj->inst_addr << ", target = " << cofi_obj->target_addr << std::endl;
 #endif
-				cofi_obj = nullptr;
+				//TNT bits still pending at a return come before its TIP would: the return was compressed into the next one.
+				if(this->ret_compression && count_tnt(tnt_cache_state) != 0) {
+					tnt = process_tnt_cache(tnt_cache_state);
+					if(tnt != TAKEN || this->ret_depth == 0) {
+						std::cerr << "error: compressed return at 0x" << std::hex << cofi_obj->inst_addr << " without a call." << std::endl;
+						cofi_obj = nullptr;
+						break;
+					}
+					this->ret_top = (this->ret_top + PT_RET_STACK_SIZE - 1) % PT_RET_STACK_SIZE;
+					this->ret_depth --;
+					uint64_t target_addr = this->ret_stack[this->ret_top];
+					if(out_of_bounds(target_addr)) {
+						cofi_obj = nullptr;
+						break;
+					}
+					alter_bitmap(target_addr);
+					cofi_obj = cofi_map[target_addr];
+					break;
+				}
+				this->walk_at_tip = true;
 				break;
 
 			case COFI_TYPE_FAR_TRANSFERS:
@@ -467,11 +1134,85 @@ uint32_t pt_packet_decoder::decode_tnt(uint64_t entry_point){
 		}
 		num_tnt_decoded ++;
         this->num_decoded_branch ++;
+		if(this->walk_at_tip) {
+			this->walk_cofi = cofi_obj;
+			return num_tnt_decoded;
+		}
 	}
 
+	this->walk_cofi = nullptr;
 	return num_tnt_decoded;
 }
 
+const cofi_inst_t* pt_packet_decoder::walk_blocks(const cofi_inst_t* cofi_obj, uint32_t* num_tnt_decoded){
+	const cofi_block_t* block;
+	uint16_t edge;
+	uint8_t tnt = process_tnt_cache(tnt_cache_state);
+	if(tnt == TNT_EMPTY){
+		return cofi_obj;
+	}
+	//the first edge depends on how the branch was reached, from then on they are all known.
+	if(tnt == TAKEN){
+		block = cofi_map.taken_block(cofi_obj);
+		if(block == nullptr){
+			return leave_blocks(cofi_obj, num_tnt_decoded);
+		}
+	}
+	else{
+		block = cofi_map.fall_block(cofi_obj);
+	}
+	edge = (uint16_t)bitmap_last_ip ^ (uint16_t)block->entry_addr;
+	while(true){
+		trace_bits[edge]++;
+		(*num_tnt_decoded) ++;
+		this->num_decoded_branch ++;
+		if(block->has_call && this->ret_compression){
+			//decode_tnt() pushes the return addresses.
+			bitmap_last_ip = block->entry_addr >> 1;
+			return cofi_map.get_record(block->entry);
+		}
+		const uint16_t* edges = cofi_map.get_block_edges(block);
+		for(uint16_t i = 0; i < block->num_jumps; i ++){
+			trace_bits[edges[i]]++;
+		}
+		*num_tnt_decoded += block->num_jumps;
+		this->num_decoded_branch += block->num_jumps;
+		bitmap_last_ip = block->last_ip;
+		cofi_obj = cofi_map.get_record(block->cofi);
+		if(cofi_obj->type != COFI_TYPE_CONDITIONAL_BRANCH){
+			return cofi_obj;
+		}
+		tnt = process_tnt_cache(tnt_cache_state);
+		if(tnt == TNT_EMPTY){
+			return cofi_obj;
+		}
+		if(tnt == TAKEN){
+			if(block->taken == 0){
+				return leave_blocks(cofi_obj, num_tnt_decoded);
+			}
+			edge = block->taken_edge;
+			block = cofi_map.get_block(block->taken);
+		}
+		else{
+			edge = block->fall_edge;
+			block = cofi_map.get_block(block->fall);
+		}
+	}
+}
+
+const cofi_inst_t* pt_packet_decoder::leave_blocks(const cofi_inst_t* cofi_obj, uint32_t* num_tnt_decoded){
+	//taken to something that is no instruction in the map.
+	uint64_t target_addr = cofi_obj->target_addr;
+	if(out_of_bounds(target_addr)){
+		std::cerr << "error: tnt target out of bounds, inst address = " << std::hex << cofi_obj->inst_addr << ", target = " << target_addr << std::endl;
+		return nullptr;
+	}
+	alter_bitmap(target_addr);
+	(*num_tnt_decoded) ++;
+	this->num_decoded_branch ++;
+	return nullptr;
+}
+
 uint64_t pt_packet_decoder::get_ip_val(unsigned char **pp, unsigned char *end, int len, uint64_t *last_ip)
 {
 	unsigned char *p = *pp;
@@ -483,7 +1224,7 @@ uint64_t pt_packet_decoder::get_ip_val(unsigned char **pp, unsigned char *end, i
 		return 0; /* out of context */
 	}
 	if (len < 4) {
-		if (!LEFT(len)) {
+		if (!LEFT(2 * len)) {
 			*last_ip = 0;
 			return 0; /* XXX error */
 		}
@@ -492,6 +1233,17 @@ uint64_t pt_packet_decoder::get_ip_val(unsigned char **pp, unsigned char *end, i
 			v = (v & ~(0xffffULL << shift)) | (b << shift);
 		}
 		v = ((int64_t)(v << (64 - 48))) >> (64 - 48); /* sign extension */
+	} else if (len == 4 || len == 6) {
+		/* 4: lower 48 bits, upper 16 from last ip; 6: the full 64 bit ip */
+		len = len == 4 ? 3 : 4;
+		if (!LEFT(2 * len)) {
+			*last_ip = 0;
+			return 0; /* XXX error */
+		}
+		for (i = 0; i < len; i++, shift += 16, p += 2) {
+			uint64_t b = *(uint16_t *)p;
+			v = (v & ~(0xffffULL << shift)) | (b << shift);
+		}
 	} else {
 		return 0; /* XXX error */
 	}
@@ -519,199 +1271,339 @@ static inline void print_unknown(unsigned char* p, unsigned char* end)
 	}
 	printf("\n");
 }
-void pt_packet_decoder::decode() {
+/* First-byte dispatch table. Every packet header maps straight to its handler
+   kind and, for fixed-length packets, its length, so the decode loop does one
+   indexed load and one (jump table) branch per packet. */
+struct pt_opcode_tables {
+	pt_opcode_desc opcode[256];
+	pt_opcode_desc ext_opcode[256];
+};
+
+static pt_opcode_tables build_opcode_tables() {
+	pt_opcode_tables t;
+	memset(&t, 0, sizeof(t));
 
+	for(int b = 0; b < 256; b ++) {
+		pt_opcode_desc& d = t.opcode[b];
+		if(b == 0) {
+			d = {PT_OP_PAD, 1};
+		}
+		else if(b == PT_PKT_GENERIC_BYTE0) {
+			d = {PT_OP_EXT, PT_PKT_GENERIC_LEN};
+		}
+		else if((b & BIT(0)) == 0) {
+			d = {PT_OP_TNT8, 1};
+		}
+		else if((b & PT_PKT_CYC_MASK) == PT_PKT_CYC_BYTE0) {
+			d = {PT_OP_CYC, 1};
+		}
+		else {
+			/* the IPBytes field in the top 3 bits gives the payload size */
+			static const uint8_t ip_len[8] = {0, 2, 4, 6, 6, 0, 8, 0};
+			uint8_t len = 1 + ip_len[b >> PT_PKT_TIP_SHIFT];
+			switch(b & PT_PKT_TIP_MASK) {
+			case PT_PKT_TIP_BYTE0:		d = {PT_OP_TIP, len}; break;
+			case PT_PKT_TIP_PGE_BYTE0:	d = {PT_OP_TIP_PGE, len}; break;
+			case PT_PKT_TIP_PGD_BYTE0:	d = {PT_OP_TIP_PGD, len}; break;
+			case PT_PKT_TIP_FUP_BYTE0:	d = {PT_OP_TIP_FUP, len}; break;
+			default: break;
+			}
+		}
+	}
+	t.opcode[PT_PKT_TSC_BYTE0] = {PT_OP_SKIP, PT_PKT_TSC_LEN};
+	t.opcode[PT_PKT_MTC_BYTE0] = {PT_OP_SKIP, PT_PKT_MTC_LEN};
+	t.opcode[PT_PKT_MODE_BYTE0] = {PT_OP_SKIP, PT_PKT_MODE_LEN};
+
+	/* second byte of the 0x02 extended opcodes */
+	t.ext_opcode[PT_PKT_PSB_BYTE1] = {PT_OP_PSB, PT_PKT_PSB_LEN};
+	t.ext_opcode[PT_PKT_LTNT_BYTE1] = {PT_OP_LTNT, PT_PKT_LTNT_LEN};
+	t.ext_opcode[PT_PKT_MNT_BYTE1] = {PT_OP_MNT, PT_PKT_MNT_LEN};
+	t.ext_opcode[PT_PKT_PSBEND_BYTE1] = {PT_OP_SKIP, PT_PKT_PSBEND_LEN};
+	t.ext_opcode[PT_PKT_PIP_BYTE1] = {PT_OP_SKIP, PT_PKT_PIP_LEN};
+	t.ext_opcode[PT_PKT_CBR_BYTE1] = {PT_OP_SKIP, PT_PKT_CBR_LEN};
+	t.ext_opcode[PT_PKT_TS_BYTE1] = {PT_OP_SKIP, PT_PKT_TS_LEN};
+	t.ext_opcode[PT_PKT_OVF_BYTE1] = {PT_OP_OVF, PT_PKT_OVF_LEN};
+	t.ext_opcode[PT_PKT_TMA_BYTE1] = {PT_OP_SKIP, PT_PKT_TMA_LEN};
+	t.ext_opcode[PT_PKT_VMCS_BYTE1] = {PT_OP_SKIP, PT_PKT_VMCS_LEN};
+	return t;
+}
+
+static const pt_opcode_tables opcode_tables = build_opcode_tables();
+
+void pt_packet_decoder::decode() {
+	if(this->perf_pt_header != nullptr) {
+		decode_aux();
+		return;
+	}
 	if(this->aux_tail >= this->aux_head) {
 		std::cerr << "failed to decode: invalid trace data: aux_head = " << this->aux_head << ", aux_tail = " << this->aux_tail << std::endl;
 		return;
 	}
-	uint8_t* map = this->pt_packets;
-	uint64_t len = this->aux_head - this->aux_tail - 1;
-	uint8_t* end = map + len;
-	unsigned char *p;
-	uint8_t byte0;
-
 #ifdef DEBUG
-	std::cout << "try to decode packet buffer: " << (uint64_t)this->pt_packets << ", aux_head = " << this->aux_head << ", aux_tail = " << this->aux_tail << ", size = " << (int64_t)len << std::endl;
+	std::cout << "try to decode packet buffer: " << (uint64_t)this->pt_packets << ", aux_head = " << this->aux_head << ", aux_tail = " << this->aux_tail << ", size = " << this->trace_size << std::endl;
 #endif
-	for (p = map; p < end; ) {
-		p = (unsigned char *)memmem(p, end - p, psb, PT_PKT_PSB_LEN);
-		if (!p) {
-			p = end;
-			break;
+	decode_chunk(this->pt_packets, this->trace_size);
+#ifdef DEBUG
+    std::cout << "all PT parckets are decoded." << std::endl;
+    std::cout << "number of TNT left undecoded: " << count_tnt(this->tnt_cache_state) << std::endl;
+#endif
+}
+
+uint64_t pt_packet_decoder::decode_aux() {
+	struct perf_event_mmap_page* pem = (struct perf_event_mmap_page*)this->perf_pt_header;
+	uint64_t aux_size = pem->aux_size;
+	uint64_t head = ATOMIC_GET(pem->aux_head);
+	uint64_t tail = pem->aux_tail;
+	uint64_t size = head - tail;
+	if(head < tail) {
+		std::cerr << "failed to decode: invalid trace data: aux_head = " << head << ", aux_tail = " << tail << std::endl;
+		return 0;
+	}
+	if(size > aux_size) {
+		//the oldest data is gone, pick up at the next PSB in what is left.
+		tail = head - aux_size;
+		this->carry_len = 0;
+		this->synced = false;
+	}
+	while(tail < head) {
+		uint64_t offset = tail & (aux_size - 1);
+		uint64_t len = std::min(head - tail, aux_size - offset);
+		decode_chunk(this->pt_packets + offset, len);
+		tail += len;
+	}
+	//hand the space back, the kernel does not write past aux_tail + aux_size.
+	ATOMIC_SET(pem->aux_tail, tail);
+	this->aux_tail = tail;
+	this->aux_head = head;
+	return size;
+}
+
+void pt_packet_decoder::decode_chunk(uint8_t* data, uint64_t size) {
+	if(this->carry_len) {
+		//finish the packet cut off by the end of the previous chunk.
+		uint64_t len = std::min(size, (uint64_t)sizeof(this->carry) - this->carry_len);
+		memcpy(this->carry + this->carry_len, data, len);
+		uint64_t glued = this->carry_len + len;
+		uint64_t used = decode_packets(this->carry, this->carry + glued) - this->carry;
+		if(used >= this->carry_len) {
+			data += used - this->carry_len;
+			size -= used - this->carry_len;
+			this->carry_len = 0;
+		}
+		else if(len == size) {
+			//the chunk did not finish it either, keep waiting.
+			memmove(this->carry, this->carry + used, glued - used);
+			this->carry_len = glued - used;
+			return;
+		}
+		else {
+			//longer than any sane packet, resync at the next PSB.
+			this->carry_len = 0;
+			this->synced = false;
 		}
+	}
+	uint8_t* stop = decode_packets(data, data + size);
+	uint64_t left = data + size - stop;
+	if(left > sizeof(this->carry) / 2) {
+		this->synced = false;
+		stop = data + size - (PT_PKT_PSB_LEN - 1);
+		left = PT_PKT_PSB_LEN - 1;
+	}
+	memcpy(this->carry, stop, left);
+	this->carry_len = left;
+}
 
-		int cnt = 0;
-		while (p < end) {
+pt_decode_thread::pt_decode_thread(int cpu) {
+	this->worker = std::thread(&pt_decode_thread::run, this);
+	if(cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if(pthread_setaffinity_np(this->worker.native_handle(), sizeof(set), &set) != 0) {
+			std::cerr << "failed to pin the decoder thread to cpu " << cpu << "." << std::endl;
+		}
+	}
+}
 
-			cnt +=1;
-			byte0 = *p;
+pt_decode_thread::~pt_decode_thread() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->quit = true;
+	}
+	this->wakeup.notify_one();
+	this->worker.join();
+}
 
-			/* pad */
-			if (byte0 == 0) {
-				//pad_handler(self, &p);
-				p ++;
-				continue;
-			}
+void pt_decode_thread::attach(pt_packet_decoder* decoder) {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->decoder = decoder;
+	}
+	this->wakeup.notify_one();
+}
 
-			//TSC
-			if (*p == PT_PKT_TSC_BYTE0 && LEFT(PT_PKT_TSC_LEN)){
-				//tsc_handler(self, &p);
-				p += PT_PKT_TSC_LEN;
-				continue;
+void pt_decode_thread::detach() {
+	//keeps the worker from starting another round while we wait for the lock.
+	this->detaching = true;
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->decoder = nullptr;
+	this->detaching = false;
+}
+
+void pt_decode_thread::run() {
+	std::unique_lock<std::mutex> lock(this->mutex);
+	while(!this->quit) {
+		if(this->decoder == nullptr || this->detaching) {
+			this->wakeup.wait(lock);
+			continue;
+		}
+		uint64_t size = this->decoder->decode_aux();
+		lock.unlock();
+		if(size == 0) {
+			usleep(this->poll_interval);
+		}
+		lock.lock();
+	}
+}
+
+uint8_t* pt_packet_decoder::decode_packets(uint8_t* p, uint8_t* end) {
+	while (p < end) {
+		if (!this->synced) {
+			uint8_t* psb_pos = pt_find_psb(p, end);
+			if (!psb_pos) {
+				//a PSB may start in the last bytes and end in the next chunk.
+				return end - p >= PT_PKT_PSB_LEN ? end - (PT_PKT_PSB_LEN - 1) : p;
 			}
+			p = psb_pos;
+			this->synced = true;
+		}
 
-			//MTC
-			if (*p == PT_PKT_MTC_BYTE0 && LEFT(PT_PKT_MTC_LEN)){
-				//mtc_handler(self, &p);
-				p += PT_PKT_MTC_LEN;
+		while (p < end) {
+			const pt_opcode_desc& desc = opcode_tables.opcode[*p];
+
+			/* PAD and TNT8 make up most of a trace; keep them off the jump table,
+			   a well predicted compare is cheaper than an indirect branch. */
+			if (desc.kind == PT_OP_PAD) {
+				p ++;
+				if (p < end && *p == 0) {
+					//more than one, could be a long padded stretch: skip it a vector at a time.
+					p = pt_skip_pad(p, end);
+				}
 				continue;
 			}
-
-			/* tnt8 */
-			if ((byte0 & BIT(0)) == 0 && byte0 != 2){
+			if (desc.kind == PT_OP_TNT8) {
 				tnt8_handler(&p);
 				continue;
 			}
+			/* everything else has its full length (or at least the fixed part) in desc.len */
+			if (!LEFT(desc.len)) return p;
 
-			/* CBR */
-			if (*p == PT_PKT_GENERIC_BYTE0 && LEFT(PT_PKT_CBR_LEN) && p[1] == PT_PKT_CBR_BYTE1) {
-				//cbr_handler(self, &p);
-				p += PT_PKT_CBR_LEN;
+			switch (desc.kind) {
+			case PT_OP_SKIP:
+				p += desc.len;
 				continue;
-			}
 
-			/* MODE */
-			if (byte0 == PT_PKT_MODE_BYTE0 && LEFT(PT_PKT_MODE_LEN)) {
-				//mode_handler(self, &p);
-				p += PT_PKT_MODE_LEN;
+			case PT_OP_TIP:
+				tip_handler(&p, &end);
 				continue;
-			}
 
-			switch (byte0 & PT_PKT_TIP_MASK) {
-
-				/* tip */
-				case PT_PKT_TIP_BYTE0:
-				{
-					tip_handler(&p, &end);
-					continue;
-				}
+			case PT_OP_TIP_PGE:
+				tip_pge_handler(&p, &end);
+				continue;
 
-				/* tip.pge */
-				case PT_PKT_TIP_PGE_BYTE0:
-				{
-					tip_pge_handler(&p, &end);
-					continue;
-				}
+			case PT_OP_TIP_PGD:
+				tip_pgd_handler(&p, &end);
+				continue;
 
-				/* tip.pgd */
-				case PT_PKT_TIP_PGD_BYTE0:
-				{
-					tip_pgd_handler( &p, &end);
-					continue;
-				}
+			case PT_OP_TIP_FUP:
+				tip_fup_handler(&p, &end);
+				continue;
 
-				/* tip.fup */
-				case PT_PKT_TIP_FUP_BYTE0:
-				{
-					tip_fup_handler( &p, &end);
-					continue;
-				}
-				default:
-					break;
-			}
+			case PT_OP_CYC:
+				if (!cyc_handler(&p, end)) return p;
+				continue;
 
-			if (*p == PT_PKT_GENERIC_BYTE0 && LEFT(PT_PKT_GENERIC_LEN)) {
+			case PT_OP_EXT: {
+				const pt_opcode_desc& ext = opcode_tables.ext_opcode[p[1]];
+				if (!LEFT(ext.len)) return p;
 
-				/* PIP */
-				if (p[1] == PT_PKT_PIP_BYTE1 && LEFT(PT_PKT_PIP_LEN)) {
-					//pip_handler(self, &p);
-					p += PT_PKT_PIP_LEN-6;
+				switch (ext.kind) {
+				case PT_OP_SKIP:
+					p += ext.len;
 					continue;
-				}
 
-				/* PSB */
-				if (p[1] == PT_PKT_PSB_BYTE1 && LEFT(PT_PKT_PSB_LEN) && !memcmp(p, psb, PT_PKT_PSB_LEN)) {
+				case PT_OP_PSB:
+					if (memcmp(p, psb, PT_PKT_PSB_LEN)) break;
 					psb_handler(&p);
 					continue;
-				}
 
-				/* PSBEND */
-				if (p[1] == PT_PKT_PSBEND_BYTE1) {
-					//psbend_handler(self, &p);
-					p += PT_PKT_PSBEND_LEN;
+				case PT_OP_OVF:
+					ovf_handler(&p);
 					continue;
-				}
 
-				/* long TNT */
-				if (p[1] == PT_PKT_LTNT_BYTE1 && LEFT(PT_PKT_LTNT_LEN)) {
+				case PT_OP_LTNT:
 #ifdef DEBUG
                     std::cout << "append long tnt" << std::endl;
 #endif
 					long_tnt_handler(&p);
 					continue;
-				}
-
-				/* TS */
-				if (p[1] == PT_PKT_TS_BYTE1) {
-					//ts_handler(self, &p);
-					p += PT_PKT_TS_LEN;
-					continue;
-				}
-
-				/* OVF */
-				if (p[1] == PT_PKT_OVF_BYTE1 && LEFT(PT_PKT_OVF_LEN)) {
-					//ovf_handler(self, &p);
-					p += PT_PKT_OVF_LEN;
-					continue;
-				}
 
-				/* MNT */
-				if (p[1] == PT_PKT_MNT_BYTE1 && LEFT(PT_PKT_MNT_LEN) && p[2] == PT_PKT_MNT_BYTE2) {
-					//mnt_handler(self, &p);
-					p += PT_PKT_MNT_LEN;
+				case PT_OP_MNT:
+					if (p[2] != PT_PKT_MNT_BYTE2) break;
+					p += ext.len;
 					continue;
-				}
 
-				/* TMA */
-				if (p[1] == PT_PKT_TMA_BYTE1 && LEFT(PT_PKT_TMA_LEN)) {
-					//tma_handler(self, &p);
-					p += PT_PKT_TMA_LEN;
-					continue;
+				default:
+					break;
 				}
+				break;
+			}
 
-				/* VMCS */
-				if (p[1] == PT_PKT_VMCS_BYTE1 && LEFT(PT_PKT_VMCS_LEN)) {
-					//vmcs_handler(self, &p);
-					p += PT_PKT_VMCS_LEN;
-					continue;
-				}
+			default:
+				break;
 			}
 
 #ifdef DEBUG
 			print_unknown(p, end);
             std::cout << "unknow pt packets." << std::endl;
 #endif
-			return;
+			//lost track of the packet boundaries, skip to the next PSB.
+			this->synced = false;
+			p ++;
+			break;
 		}
 	}
-#ifdef DEBUG
-    std::cout << "all PT parckets are decoded." << std::endl;
-#endif
-#ifdef DEBUG
-    std::cout << "number of TNT left undecoded: " << count_tnt(this->tnt_cache_state) << std::endl;
-#endif
-
+	return p;
 }
 
 void pt_packet_decoder::flush(){
-	this->last_tip = 0;
+	//bits the walk could not use (it got lost, or left the map) must not steer the next one.
+	tnt_cache_reset(this->tnt_cache_state);
+	this->ret_depth = 0;
+	this->walk_cofi = nullptr;
+	this->walk_at_tip = false;
+	this->walk_edge_ip = 0;
 	this->last_ip2 = 0;
 	this->fup_pkt = false;
 	this->isr = false;
 	this->in_range = false;
 }
 
+void pt_packet_decoder::tnt_overflow(){
+	//the bits still cached come before the lost ones and can be followed.
+	decode_tnt();
+#ifdef DEBUG
+	std::cout << "tnt cache full, dropped " << tnt_cache_state->dropped << " bits" << std::endl;
+#endif
+	this->num_tnt_dropped += tnt_cache_state->dropped;
+	tnt_cache_reset(tnt_cache_state);
+	this->ret_depth = 0;
+	this->walk_cofi = nullptr;
+	this->walk_at_tip = false;
+	this->walk_edge_ip = 0;
+	this->wait_psb = true;
+}
+
 
 extern "C" {
 pt_fuzzer* the_fuzzer;
@@ -732,14 +1624,35 @@ void start_pt_fuzzer(int pid){
 	the_fuzzer->start = std::chrono::steady_clock::now();
 }
 
-void stop_pt_fuzzer(uint8_t *trace_bits){
+void set_pt_fork_server(int on){
+	the_fuzzer->set_fork_server(on != 0);
+}
+
+void set_pt_trace_bits(uint8_t* trace_bits){
+	the_fuzzer->set_trace_bits(trace_bits);
+}
+
+void set_pt_target(char* path){
+	the_fuzzer->set_target(path);
+}
+
+uint64_t tune_pt_aux_size(void){
+	return the_fuzzer->tune_aux_size();
+}
+
+void get_pt_fuzzer_stats(pt_fuzzer_stats_t* stats){
+	*stats = the_fuzzer->stats;
+	stats->cofi_inst = the_fuzzer->num_cofi_inst();
+}
+
+static void finish_pt_fuzzer(uint8_t *trace_bits, bool keep_tracer){
 	the_fuzzer->end = std::chrono::steady_clock::now();
 	the_fuzzer->diff = the_fuzzer->end - the_fuzzer->start;
 #ifdef DEBUG
 	std::cout << "Time of exec: " << the_fuzzer->diff.count()*1000000000 << std::endl;
 #endif
 	the_fuzzer->start = std::chrono::steady_clock::now();
-	the_fuzzer->stop_pt_trace(trace_bits);
+	the_fuzzer->stop_pt_trace(trace_bits, keep_tracer);
 	the_fuzzer->end = std::chrono::steady_clock::now();
 	the_fuzzer->diff = the_fuzzer->end - the_fuzzer->start;
 #ifdef DEBUG
@@ -747,4 +1660,12 @@ void stop_pt_fuzzer(uint8_t *trace_bits){
 #endif
 }
 
+void stop_pt_fuzzer(uint8_t *trace_bits){
+	finish_pt_fuzzer(trace_bits, false);
+}
+
+void pause_pt_fuzzer(uint8_t *trace_bits){
+	finish_pt_fuzzer(trace_bits, true);
+}
+
 }
\ No newline at end of file
@@ -4,9 +4,44 @@
 #ifdef __cplusplus
 extern "C"{
 #endif
+typedef struct {
+	uint64_t execs;
+	//time spent opening and closing the PT event and its mappings.
+	uint64_t setup_ns;
+	uint64_t decode_ns;
+	uint8_t tracer_pool;
+	//address ranges of the hardware IP filter, 0 if unfiltered.
+	uint8_t filter_ranges;
+	uint64_t aux_size;
+	//execs whose trace did not fit into the aux ring, their coverage is incomplete.
+	uint64_t overflows;
+	//AFL_PT_SNAPSHOT: bytes decoded from the end of each trace, 0 to decode all of it.
+	uint64_t snapshot_size;
+	//attr.config of the PT event, and the PSB period in bytes it gives.
+	uint64_t pt_config;
+	uint64_t psb_period;
+	//the cofi map was mapped from AFL_PT_COFI_CACHE instead of disassembled.
+	uint8_t cofi_cached;
+	//records in the cofi map, with AFL_PT_LAZY_DISASM those of the code reached so far.
+	uint64_t cofi_inst;
+	//TNT bits lost to a full TNT cache, the decoder skipped to the next PSB after each loss.
+	uint64_t tnt_dropped;
+} pt_fuzzer_stats_t;
+
 void init_pt_fuzzer(char* raw_bin_file, uint64_t min_addr, uint64_t max_addr, uint64_t entry_point);
 void start_pt_fuzzer(int pid);
 void stop_pt_fuzzer(uint8_t *trace_bits);
+//like stop_pt_fuzzer(), for a persistent mode child that stopped after an iteration; start_pt_fuzzer() with its pid resumes tracing.
+void pause_pt_fuzzer(uint8_t *trace_bits);
+//the pids passed to start_pt_fuzzer() are fork server children, which are held until it returns instead of exec'ing.
+void set_pt_fork_server(int on);
+//the bitmap later passed to stop_pt_fuzzer(). It is zeroed before every exec, so the decoder counts edges straight into it.
+void set_pt_trace_bits(uint8_t* trace_bits);
+//the target binary, to filter the trace on its code (AFL_PT_FILTER narrows that down, AFL_PT_NO_FILTER turns it off).
+void set_pt_target(char* path);
+void get_pt_fuzzer_stats(pt_fuzzer_stats_t* stats);
+//with AFL_PT_AUX_SIZE=auto, fit the aux ring to the traces seen so far. Returns its size.
+uint64_t tune_pt_aux_size(void);
 
 void wrmsr_on_all_cpus(uint32_t reg, int valcnt, char *regvals[]);
 void rdmsr_on_all_cpus(uint32_t reg);
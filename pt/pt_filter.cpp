@@ -0,0 +1,135 @@
+#include "pt_filter.h"
+#include <elf.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <algorithm>
+
+//the kernel prints caps in hex.
+uint32_t pt_filter_num_ranges() {
+	FILE* fp = fopen("/sys/bus/event_source/devices/intel_pt/caps/num_address_ranges", "r");
+	if(fp == nullptr) {
+		return 0;
+	}
+	unsigned int num = 0;
+	if(fscanf(fp, "%x", &num) != 1) {
+		num = 0;
+	}
+	fclose(fp);
+	return num;
+}
+
+bool pt_filter_parse_ranges(const char* spec, std::vector<pt_addr_range_t>& ranges) {
+	const char* p = spec;
+	while(*p) {
+		char* end;
+		pt_addr_range_t range;
+		range.start = strtoull(p, &end, 0);
+		if(end == p || *end != '-') {
+			return false;
+		}
+		p = end + 1;
+		range.end = strtoull(p, &end, 0);
+		if(end == p || range.end <= range.start) {
+			return false;
+		}
+		ranges.push_back(range);
+		p = end;
+		if(*p == ',') {
+			p ++;
+		}
+		else if(*p) {
+			return false;
+		}
+	}
+	return !ranges.empty();
+}
+
+//file offset ranges of the executable PT_LOAD segments, restricted to ranges if there are any.
+static bool file_ranges(const char* elf_path, const std::vector<pt_addr_range_t>& ranges, std::vector<pt_addr_range_t>& offsets) {
+	FILE* fp = fopen(elf_path, "rb");
+	if(fp == nullptr) {
+		std::cerr << "open " << elf_path << " failed." << std::endl;
+		return false;
+	}
+	Elf64_Ehdr ehdr;
+	if(fread(&ehdr, sizeof(ehdr), 1, fp) != 1 || memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_ident[EI_CLASS] != ELFCLASS64) {
+		std::cerr << elf_path << " is not a 64-bit ELF file." << std::endl;
+		fclose(fp);
+		return false;
+	}
+	std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+	if(fseek(fp, ehdr.e_phoff, SEEK_SET) != 0 || fread(phdrs.data(), sizeof(Elf64_Phdr), phdrs.size(), fp) != phdrs.size()) {
+		std::cerr << "read program headers of " << elf_path << " failed." << std::endl;
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+
+	for(auto& phdr : phdrs) {
+		if(phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X) || phdr.p_filesz == 0) {
+			continue;
+		}
+		uint64_t seg_start = phdr.p_vaddr;
+		uint64_t seg_end = phdr.p_vaddr + phdr.p_filesz;
+		if(ranges.empty()) {
+			offsets.push_back({phdr.p_offset, phdr.p_offset + phdr.p_filesz});
+			continue;
+		}
+		for(auto& range : ranges) {
+			uint64_t start = std::max(range.start, seg_start);
+			uint64_t end = std::min(range.end, seg_end);
+			if(start < end) {
+				offsets.push_back({start - seg_start + phdr.p_offset, end - seg_start + phdr.p_offset});
+			}
+		}
+	}
+	return true;
+}
+
+//merge neighbours with the smallest gap until there are at most max_ranges.
+static void merge_ranges(std::vector<pt_addr_range_t>& ranges, uint32_t max_ranges) {
+	std::sort(ranges.begin(), ranges.end(), [](const pt_addr_range_t& a, const pt_addr_range_t& b) { return a.start < b.start; });
+	while(ranges.size() > 1) {
+		size_t best = 0;
+		uint64_t best_gap = UINT64_MAX;
+		for(size_t i = 0; i + 1 < ranges.size(); i ++) {
+			uint64_t gap = ranges[i + 1].start > ranges[i].end ? ranges[i + 1].start - ranges[i].end : 0;
+			if(gap < best_gap) {
+				best_gap = gap;
+				best = i;
+			}
+		}
+		if(best_gap > 0 && ranges.size() <= max_ranges) {
+			break;
+		}
+		ranges[best].end = std::max(ranges[best].end, ranges[best + 1].end);
+		ranges.erase(ranges.begin() + best + 1);
+	}
+}
+
+std::string pt_filter_build(const char* elf_path, const std::vector<pt_addr_range_t>& ranges, uint32_t max_ranges, uint32_t* num_ranges) {
+	*num_ranges = 0;
+	char path[PATH_MAX];
+	//the kernel resolves the path itself.
+	if(max_ranges == 0 || realpath(elf_path, path) == nullptr) {
+		return "";
+	}
+	std::vector<pt_addr_range_t> offsets;
+	if(!file_ranges(path, ranges, offsets) || offsets.empty()) {
+		return "";
+	}
+	merge_ranges(offsets, max_ranges);
+
+	std::string filter;
+	for(auto& range : offsets) {
+		char buf[PATH_MAX + 64];
+		snprintf(buf, sizeof(buf), "%sfilter 0x%" PRIx64 "/0x%" PRIx64 "@%s", filter.empty() ? "" : ",", range.start, range.end - range.start, path);
+		filter += buf;
+	}
+	*num_ranges = offsets.size();
+	return filter;
+}
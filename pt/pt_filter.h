@@ -0,0 +1,31 @@
+#ifndef _PT_FILTER_H_
+#define _PT_FILTER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Hardware IP filtering. Without a filter the PT unit writes packets for all
+   user mode code of the target, ld.so and libc included, and the decoder
+   throws away everything outside [min_address, max_address]. Address range
+   filters (PERF_EVENT_IOC_SET_FILTER) make the cpu drop that code instead.
+
+   User space filters are given as file offset ranges of a mapped object:
+   "filter <offset>/<size>@<path>". The ranges to trace are translated into
+   offsets of the executable segments of the target binary, and merged until
+   they fit into the filter slots the cpu has (caps/num_address_ranges). */
+
+typedef struct {
+	uint64_t start;
+	uint64_t end;
+} pt_addr_range_t;
+
+//address range filters the PT unit supports, 0 if none.
+uint32_t pt_filter_num_ranges();
+//"start-end[,start-end...]", as in AFL_PT_FILTER.
+bool pt_filter_parse_ranges(const char* spec, std::vector<pt_addr_range_t>& ranges);
+//filter for the parts of ranges (addresses as linked) that are executable code of elf_path, all of its code if ranges is empty.
+//at most max_ranges ranges are used, num_ranges is set to how many. Empty if there is nothing to filter on.
+std::string pt_filter_build(const char* elf_path, const std::vector<pt_addr_range_t>& ranges, uint32_t max_ranges, uint32_t* num_ranges);
+
+#endif
@@ -0,0 +1,210 @@
+#include "pt_trace_gen.h"
+#include "pt_parallel.h"
+#include <iostream>
+#include <vector>
+
+/* Write synthetic PT traces in the AFL_PT_CAPTURE_DIR format, so they can be
+   fed to pt_replay, and optionally check that pt_packet_decoder rebuilds the
+   bitmap the generator expects. Intel PT is not needed. */
+
+static bool read_raw_bin(const char* path, uint64_t code_size, std::vector<uint8_t>& code)
+{
+    FILE* fp = fopen(path, "rb");
+    if(fp == nullptr) {
+        return false;
+    }
+    code.assign(code_size, 0);
+    size_t count = fread(code.data(), 1, code_size, fp);
+    fclose(fp);
+    return count == code_size;
+}
+
+static bool read_path(const char* path_file, std::vector<uint64_t>& path)
+{
+    FILE* fp = fopen(path_file, "r");
+    if(fp == nullptr) {
+        return false;
+    }
+    char line[64];
+    while(fgets(line, sizeof(line), fp)) {
+        if(line[0] != '#' && line[0] != '\n') {
+            path.push_back(strtoull(line, nullptr, 0));
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+//accepts k, m and g suffixes.
+static uint64_t parse_size(const char* str)
+{
+    char* suffix;
+    uint64_t size = strtoull(str, &suffix, 0);
+    switch(*suffix) {
+    case 'g': case 'G': size <<= 10;
+    case 'm': case 'M': size <<= 10;
+    case 'k': case 'K': size <<= 10;
+    }
+    return size;
+}
+
+static void usage(char* argv0)
+{
+    std::cout << argv0 << " [-s seed] [-n size] [-p path_file] [-r] [-c] <raw_bin> <min_addr> <max_addr> <entry_point> <out.pt>" << std::endl;
+    std::cout << "  -s seed       seed of the random walk, default 0" << std::endl;
+    std::cout << "  -n size       trace size of the random walk, e.g. 4k, 16m, 1g, default 1m" << std::endl;
+    std::cout << "  -p path_file  follow the addresses in path_file, one per line, instead of a random walk" << std::endl;
+    std::cout << "  -r            compress returns, as with AFL_PT_RET_COMPRESSION" << std::endl;
+    std::cout << "  -c            decode the trace and compare with the expected bitmap" << std::endl;
+    exit(0);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t seed = 0;
+    uint64_t trace_size = 1024 * 1024;
+    char* path_file = nullptr;
+    bool check = false;
+    bool ret_compression = false;
+    int opt;
+    while((opt = getopt(argc, argv, "s:n:p:rc")) > 0) {
+        switch(opt) {
+        case 's':
+            seed = strtoull(optarg, nullptr, 0);
+            break;
+        case 'n':
+            trace_size = parse_size(optarg);
+            break;
+        case 'p':
+            path_file = optarg;
+            break;
+        case 'r':
+            ret_compression = true;
+            break;
+        case 'c':
+            check = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(argc - optind < 5) {
+        usage(argv[0]);
+    }
+    char* raw_bin = argv[optind];
+    uint64_t min_address = strtoull(argv[optind + 1], nullptr, 0);
+    uint64_t max_address = strtoull(argv[optind + 2], nullptr, 0);
+    uint64_t entry_point = strtoull(argv[optind + 3], nullptr, 0);
+    char* out_file = argv[optind + 4];
+
+    std::vector<uint8_t> code;
+    if(!read_raw_bin(raw_bin, max_address - min_address, code)) {
+        std::cerr << "read raw binary failed." << std::endl;
+        exit(-1);
+    }
+    cofi_map_t cofi_map;
+    uint32_t num_cofi_inst = disassemble_binary(code.data(), min_address, max_address, cofi_map);
+    std::cout << "number of cofi inst: " << num_cofi_inst << std::endl;
+
+    pt_trace_generator generator(cofi_map, min_address, max_address, entry_point, seed);
+    generator.ret_compression = ret_compression;
+    bool ok;
+    if(path_file) {
+        std::vector<uint64_t> path;
+        if(!read_path(path_file, path)) {
+            std::cerr << "read path file failed." << std::endl;
+            exit(-1);
+        }
+        ok = generator.follow_path(path);
+    }
+    else {
+        ok = generator.random_walk(trace_size);
+    }
+    if(!ok) {
+        exit(-1);
+    }
+
+    std::vector<uint8_t>& trace = generator.get_trace();
+    pt_trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.aux_head = trace.size();
+    header.aux_tail = 0;
+    header.min_address = min_address;
+    header.max_address = max_address;
+    header.entry_point = entry_point;
+    if(!pt_trace_write(out_file, &header, trace.data(), trace.size())) {
+        exit(-1);
+    }
+    std::cout << out_file << ": " << trace.size() << " bytes, " << generator.num_decoded_branch << " branches" << std::endl;
+
+    if(check) {
+        //branch by branch, then through the TNT run cache, cold and warm, then streamed in odd sized chunks.
+        tnt_run_cache run_cache(cofi_map, min_address, max_address, ret_compression);
+        tnt_run_cache* caches[] = {nullptr, &run_cache, &run_cache, &run_cache};
+        for(int pass = 0; pass < 4; pass ++) {
+            tnt_run_cache* cache = caches[pass];
+            pt_packet_decoder decoder(trace.data(), trace.size(), cofi_map, min_address, max_address, entry_point, cache);
+            decoder.set_ret_compression(ret_compression);
+            if(pass < 3) {
+                decoder.decode();
+            }
+            else {
+                std::mt19937_64 rng(seed);
+                for(uint64_t offset = 0; offset < trace.size(); ) {
+                    uint64_t len = std::min((uint64_t)(rng() % 2 ? 1 + rng() % 32 : 1 + rng() % 8192), trace.size() - offset);
+                    decoder.decode_chunk(trace.data() + offset, len);
+                    offset += len;
+                }
+            }
+            bool same_bitmap = memcmp(decoder.get_trace_bits(), generator.get_trace_bits(), MAP_SIZE) == 0;
+            bool same_branches = decoder.num_decoded_branch == generator.num_decoded_branch;
+            std::cout << "decoded branches" << (pass == 3 ? " (chunked)" : cache ? " (run cache)" : "") << ": " << decoder.num_decoded_branch << ", bitmap "
+                      << (same_bitmap ? "matches" : "differs") << std::endl;
+            if(!same_bitmap || !same_branches) {
+                std::cerr << "check failed." << std::endl;
+                exit(1);
+            }
+        }
+        //and split at PSBs over 4 threads, with small segments so that many edges cross a boundary.
+        pt_parallel_decoder parallel(cofi_map, min_address, max_address, entry_point, 4, true, ret_compression);
+        parallel.min_segment_size = 4096;
+        parallel.decode(trace.data(), trace.size());
+        bool same_bitmap = memcmp(parallel.get_trace_bits(), generator.get_trace_bits(), MAP_SIZE) == 0;
+        std::cout << "decoded branches (" << parallel.num_segments << " segments, " << parallel.num_redecoded << " decoded again): "
+                  << parallel.num_decoded_branch << ", bitmap " << (same_bitmap ? "matches" : "differs") << std::endl;
+        if(!same_bitmap || parallel.num_decoded_branch != generator.num_decoded_branch) {
+            std::cerr << "check failed." << std::endl;
+            exit(1);
+        }
+        //and on lazy maps, branch by branch, and filled in by 4 threads at once.
+        for(int pass = 0; pass < 2; pass ++) {
+            cofi_map_t lazy_map;
+            if(!lazy_map.init_lazy(code.data(), min_address, max_address)) {
+                std::cerr << "set up lazy disassembly failed." << std::endl;
+                exit(-1);
+            }
+            uint64_t num_decoded_branch;
+            if(pass == 0) {
+                pt_packet_decoder decoder(trace.data(), trace.size(), lazy_map, min_address, max_address, entry_point);
+                decoder.set_ret_compression(ret_compression);
+                decoder.decode();
+                same_bitmap = memcmp(decoder.get_trace_bits(), generator.get_trace_bits(), MAP_SIZE) == 0;
+                num_decoded_branch = decoder.num_decoded_branch;
+            }
+            else {
+                pt_parallel_decoder lazy_parallel(lazy_map, min_address, max_address, entry_point, 4, true, ret_compression);
+                lazy_parallel.min_segment_size = 4096;
+                lazy_parallel.decode(trace.data(), trace.size());
+                same_bitmap = memcmp(lazy_parallel.get_trace_bits(), generator.get_trace_bits(), MAP_SIZE) == 0;
+                num_decoded_branch = lazy_parallel.num_decoded_branch;
+            }
+            std::cout << "decoded branches (lazy map" << (pass ? ", 4 threads" : "") << ", " << lazy_map.size() << " of " << num_cofi_inst
+                      << " cofi inst): " << num_decoded_branch << ", bitmap " << (same_bitmap ? "matches" : "differs") << std::endl;
+            if(!same_bitmap || num_decoded_branch != generator.num_decoded_branch) {
+                std::cerr << "check failed." << std::endl;
+                exit(1);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,177 @@
+#include "pt_parallel.h"
+#include "pt_scan.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void add_trace_bits(uint8_t* dst, const uint8_t* src) {
+#ifdef __SSE2__
+	for(uint32_t i = 0; i < MAP_SIZE; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(a, b));
+	}
+#else
+	for(uint32_t i = 0; i < MAP_SIZE; i ++) {
+		dst[i] += src[i];
+	}
+#endif
+}
+
+pt_parallel_decoder::pt_parallel_decoder(const cofi_map_t& map, uint64_t min_address, uint64_t max_address, uint64_t entry_point,
+		uint32_t num_threads, bool use_run_cache, bool ret_compression) :
+		cofi_map(map), min_address(min_address), max_address(max_address), app_entry_point(entry_point), ret_compression(ret_compression) {
+	if(num_threads == 0) {
+		num_threads = 1;
+	}
+	for(uint32_t i = 0; i < num_threads; i ++) {
+		run_caches.push_back(use_run_cache ? new tnt_run_cache(map, min_address, max_address, ret_compression) : nullptr);
+	}
+	for(uint32_t i = 0; i < num_threads * 4; i ++) {
+		segments.push_back(new pt_packet_decoder(map, min_address, max_address, entry_point));
+	}
+	for(uint32_t i = 1; i < num_threads; i ++) {
+		workers.push_back(std::thread(&pt_parallel_decoder::run, this, i));
+	}
+	trace_bits = (uint8_t*)malloc(MAP_SIZE);
+	memset(trace_bits, 0, MAP_SIZE);
+}
+
+pt_parallel_decoder::~pt_parallel_decoder() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->quit = true;
+	}
+	this->wakeup.notify_all();
+	for(auto& worker : this->workers) {
+		worker.join();
+	}
+	for(auto decoder : this->segments) {
+		delete decoder;
+	}
+	for(auto cache : this->run_caches) {
+		delete cache;
+	}
+	free(this->trace_bits);
+}
+
+void pt_parallel_decoder::split(uint64_t size, uint32_t max_segments) {
+	uint64_t count = std::max((uint64_t)1, std::min((uint64_t)max_segments, size / this->min_segment_size));
+	this->bounds.assign(1, 0);
+	//the first segment has to hold a PSB, or the next one could only be decoded serially.
+	uint8_t* first_psb = pt_find_psb(this->trace, this->trace + size);
+	uint64_t min_offset = first_psb ? first_psb - this->trace + 1 : size;
+	for(uint64_t i = 1; i < count; i ++) {
+		uint64_t offset = std::max(size * i / count, min_offset);
+		if(offset >= size) {
+			break;
+		}
+		uint8_t* psb_pos = pt_find_psb(this->trace + offset, this->trace + size);
+		if(psb_pos == nullptr) {
+			break;
+		}
+		this->bounds.push_back(psb_pos - this->trace);
+		min_offset = this->bounds.back() + 1;
+	}
+	this->bounds.push_back(size);
+	this->num_segments = this->bounds.size() - 1;
+}
+
+void pt_parallel_decoder::decode(uint8_t* trace, uint64_t size, bool mid_trace) {
+	this->trace = trace;
+	this->mid_trace = mid_trace;
+	split(size, this->segments.size());
+	this->next_segment = 0;
+	if(!this->workers.empty() && this->num_segments > 1) {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->generation ++;
+			this->num_busy = this->workers.size();
+		}
+		this->wakeup.notify_all();
+		decode_segments(0);
+		std::unique_lock<std::mutex> lock(this->mutex);
+		this->done.wait(lock, [this] { return this->num_busy == 0; });
+	}
+	else {
+		decode_segments(0);
+	}
+	join();
+}
+
+void pt_parallel_decoder::run(uint32_t slot) {
+	uint64_t seen = 0;
+	std::unique_lock<std::mutex> lock(this->mutex);
+	while(true) {
+		this->wakeup.wait(lock, [&] { return this->quit || this->generation != seen; });
+		if(this->quit) {
+			return;
+		}
+		seen = this->generation;
+		lock.unlock();
+		decode_segments(slot);
+		lock.lock();
+		if(-- this->num_busy == 0) {
+			this->done.notify_one();
+		}
+	}
+}
+
+void pt_parallel_decoder::decode_segments(uint32_t slot) {
+	uint32_t i;
+	while((i = this->next_segment ++) < this->num_segments) {
+		uint8_t* data = this->trace + this->bounds[i];
+		uint64_t size = this->bounds[i + 1] - this->bounds[i];
+		pt_packet_decoder* decoder = this->segments[i];
+		decoder->reset(data, size);
+		//the run cache of the thread that decodes it, which is not the same every time.
+		decoder->run_cache = this->run_caches[slot];
+		//every segment starts at a PSB, which empties the return stack as well.
+		decoder->set_ret_compression(this->ret_compression);
+		if(i > 0 || this->mid_trace) {
+			decoder->start_mid_trace();
+		}
+		decoder->decode_chunk(data, size);
+	}
+}
+
+void pt_parallel_decoder::join() {
+	//decoders whose bitmaps make up the result, and the first edges to move.
+	std::vector<pt_packet_decoder*> shards;
+	std::vector<std::pair<uint16_t, uint16_t>> moves;
+	pt_packet_decoder* prev = this->segments[0];
+	shards.push_back(prev);
+	this->num_redecoded = 0;
+	for(uint32_t i = 1; i < this->num_segments; i ++) {
+		pt_packet_decoder* decoder = this->segments[i];
+		if(prev->synced && prev->carry_len == 0 && prev->start_decode && prev->pge_enabled && is_empty_tnt_cache(prev->tnt_cache_state)) {
+			if(decoder->first_edge_addr != 0) {
+				uint16_t addr16 = (uint16_t)decoder->first_edge_addr;
+				moves.push_back(std::make_pair(addr16, (uint16_t)((uint16_t)prev->bitmap_last_ip ^ addr16)));
+			}
+			else {
+				decoder->bitmap_last_ip = prev->bitmap_last_ip;
+			}
+			shards.push_back(decoder);
+			prev = decoder;
+		}
+		else {
+			//the guess was wrong, carry on with the state the trace really has here.
+			prev->decode_chunk(this->trace + this->bounds[i], this->bounds[i + 1] - this->bounds[i]);
+			this->num_redecoded ++;
+		}
+	}
+
+	memcpy(this->trace_bits, shards[0]->trace_bits, MAP_SIZE);
+	this->num_decoded_branch = shards[0]->num_decoded_branch;
+	this->num_tnt_dropped = shards[0]->num_tnt_dropped;
+	for(size_t i = 1; i < shards.size(); i ++) {
+		add_trace_bits(this->trace_bits, shards[i]->trace_bits);
+		this->num_decoded_branch += shards[i]->num_decoded_branch;
+		this->num_tnt_dropped += shards[i]->num_tnt_dropped;
+	}
+	for(auto& move : moves) {
+		this->trace_bits[move.first] --;
+		this->trace_bits[move.second] ++;
+	}
+}
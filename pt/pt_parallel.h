@@ -0,0 +1,75 @@
+#ifndef _PT_PARALLEL_H_
+#define _PT_PARALLEL_H_
+
+#include <vector>
+#include "pt.h"
+
+/* Decode one large trace on several threads. PSB is a sync point: it resets
+   the IP compression and the decoder picks up from there without knowing what
+   came before. The trace is cut at PSBs into segments, and each segment is
+   decoded by its own pt_packet_decoder into a private bitmap shard.
+
+   A segment is decoded on the assumption that it starts in the usual state:
+   the entry point was reached, tracing is enabled (TIP.PGE), no TNT bits are
+   left over and the previous segment ended on a packet boundary. The segments
+   are then joined in trace order. The edge from the last block of one segment
+   to the first block of the next is moved to the right bitmap index. If the
+   previous segment actually ended in another state, the segment is decoded
+   again, serially, by the previous segment's decoder. So the result is always
+   the same as a single pt_packet_decoder over the whole trace.
+
+   The worker threads, their TNT run caches and the segment decoders live as
+   long as the object. */
+
+class pt_parallel_decoder {
+	const cofi_map_t& cofi_map;
+	uint64_t min_address;
+	uint64_t max_address;
+	uint64_t app_entry_point;
+	bool ret_compression;
+
+	std::vector<std::thread> workers;
+	//one per thread, slot 0 belongs to the thread calling decode().
+	std::vector<tnt_run_cache*> run_caches;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::condition_variable done;
+	uint64_t generation = 0;
+	uint32_t num_busy = 0;
+	bool quit = false;
+
+	//the current job.
+	uint8_t* trace = nullptr;
+	std::vector<uint64_t> bounds;
+	//one decoder per segment slot, reset() for every job.
+	std::vector<pt_packet_decoder*> segments;
+	std::atomic<uint32_t> next_segment{0};
+	bool mid_trace = false;
+
+	uint8_t* trace_bits;
+public:
+	uint64_t num_decoded_branch = 0;
+	uint64_t num_tnt_dropped = 0;
+	//segments of the last decode(), and how many of them had to be decoded again.
+	uint32_t num_segments = 0;
+	uint32_t num_redecoded = 0;
+	//smallest segment worth a decoder of its own.
+	uint64_t min_segment_size = 64 * 1024;
+public:
+	pt_parallel_decoder(const cofi_map_t& map, uint64_t min_address, uint64_t max_address, uint64_t entry_point, uint32_t num_threads,
+			bool use_run_cache = true, bool ret_compression = false);
+	~pt_parallel_decoder();
+	//mid_trace: the trace is the end of a longer one, see pt_packet_decoder::start_mid_trace().
+	void decode(uint8_t* trace, uint64_t size, bool mid_trace = false);
+	uint8_t* get_trace_bits() { return trace_bits; }
+private:
+	void split(uint64_t size, uint32_t max_segments);
+	void run(uint32_t slot);
+	void decode_segments(uint32_t slot);
+	void join();
+};
+
+//dst[i] += src[i] for a whole bitmap, wrapping like the decoder's own counters.
+void add_trace_bits(uint8_t* dst, const uint8_t* src);
+
+#endif
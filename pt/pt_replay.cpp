@@ -0,0 +1,264 @@
+#include "pt.h"
+#include "pt_parallel.h"
+#include "cofi_cache.h"
+#include <iostream>
+#include <vector>
+
+/* Feed traces captured with AFL_PT_CAPTURE_DIR through pt_packet_decoder and
+   report decoder throughput. Runs anywhere, Intel PT is not needed. */
+
+static bool read_raw_bin(const char* path, uint64_t code_size, std::vector<uint8_t>& code)
+{
+    FILE* fp = fopen(path, "rb");
+    if(fp == nullptr) {
+        return false;
+    }
+    code.assign(code_size, 0);
+    size_t count = fread(code.data(), 1, code_size, fp);
+    fclose(fp);
+    return count == code_size;
+}
+
+/* Play the kernel's part for a target that writes rate MB/s of trace (0 for
+   as fast as the ring drains): copy the trace into a perf style aux ring and
+   publish aux_head every watermark bytes, while decode_thread decodes it.
+   Returns the time from the target's exit until the decoder caught up, which
+   is what AFL waits for after each execution. */
+static std::chrono::duration<double> replay_growing(pt_decode_thread* decode_thread, pt_packet_decoder* decoder, struct perf_event_mmap_page* pem,
+        uint8_t* aux, const uint8_t* trace, uint64_t trace_size, double rate, uint64_t watermark)
+{
+    uint64_t aux_size = pem->aux_size;
+    uint64_t head = 0;
+    decode_thread->attach(decoder);
+    auto start = std::chrono::steady_clock::now();
+    while(head < trace_size) {
+        uint64_t len = std::min(watermark, trace_size - head);
+        while(head + len - __atomic_load_n(&pem->aux_tail, __ATOMIC_SEQ_CST) > aux_size) {
+            std::this_thread::yield();
+        }
+        uint64_t offset = head & (aux_size - 1);
+        uint64_t first = std::min(len, aux_size - offset);
+        memcpy(aux + offset, trace + head, first);
+        memcpy(aux, trace + head + first, len - first);
+        head += len;
+        if(rate > 0) {
+            std::this_thread::sleep_until(start + std::chrono::duration<double>(head / (rate * 1024 * 1024)));
+        }
+        __atomic_store_n(&pem->aux_head, head, __ATOMIC_SEQ_CST);
+    }
+    auto exited = std::chrono::steady_clock::now();
+    decode_thread->detach();
+    decoder->decode_aux();
+    return std::chrono::steady_clock::now() - exited;
+}
+
+static void usage(char* argv0)
+{
+    std::cout << argv0 << " [-n iterations] [-s] [-e] [-r] [-k chunk_size] [-t rate] [-j threads] [-m cache_dir] [-l] <raw_bin> <trace.pt> [trace.pt ...]" << std::endl;
+    std::cout << "  -s  decode block by block along the block graph, without the TNT run cache" << std::endl;
+    std::cout << "  -e  the traces are the end of a run, as captured with AFL_PT_SNAPSHOT" << std::endl;
+    std::cout << "  -r  the traces were recorded with AFL_PT_RET_COMPRESSION" << std::endl;
+    std::cout << "  -k  feed the decoder chunk_size bytes at a time, like draining a small aux ring" << std::endl;
+    std::cout << "  -t  also replay through a growing aux ring written at rate MB/s (0: unthrottled) while a" << std::endl;
+    std::cout << "      decoder thread follows it, and report the time left to decode once the writer is done" << std::endl;
+    std::cout << "  -j  also decode each trace split at PSBs over threads threads, and check it gives the same bitmap" << std::endl;
+    std::cout << "  -m  map the cofi map from cache_dir, or save it there, as with AFL_PT_COFI_CACHE" << std::endl;
+    std::cout << "  -l  disassemble only the code the traces reach, as with AFL_PT_LAZY_DISASM" << std::endl;
+    exit(0);
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t iterations = 10;
+    bool use_run_cache = true;
+    uint64_t chunk_size = 0;
+    double rate = -1;
+    uint32_t num_threads = 0;
+    bool mid_trace = false;
+    bool ret_compression = false;
+    char* cache_dir = nullptr;
+    bool lazy = false;
+    int opt;
+    while((opt = getopt(argc, argv, "n:serk:t:j:m:l")) > 0) {
+        switch(opt) {
+        case 'n':
+            iterations = strtoul(optarg, nullptr, 0);
+            break;
+        case 's':
+            use_run_cache = false;
+            break;
+        case 'e':
+            mid_trace = true;
+            break;
+        case 'r':
+            ret_compression = true;
+            break;
+        case 'k':
+            chunk_size = strtoull(optarg, nullptr, 0);
+            break;
+        case 't':
+            rate = strtod(optarg, nullptr);
+            break;
+        case 'j':
+            num_threads = strtoul(optarg, nullptr, 0);
+            break;
+        case 'm':
+            cache_dir = optarg;
+            break;
+        case 'l':
+            lazy = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(argc - optind < 2 || iterations == 0) {
+        usage(argv[0]);
+    }
+    char* raw_bin = argv[optind];
+
+    std::vector<uint8_t> code;
+    cofi_map_t cofi_map;
+    tnt_run_cache* run_cache = nullptr;
+    uint64_t min_address = 0, max_address = 0;
+
+    //same ring size and watermark as pt_fuzzer with AFL_PT_DECODE_THREAD.
+    pt_decode_thread* decode_thread = nullptr;
+    struct perf_event_mmap_page* pem = nullptr;
+    uint8_t* aux = nullptr;
+    if(rate >= 0) {
+        decode_thread = new pt_decode_thread();
+        pem = (struct perf_event_mmap_page*)calloc(1, sizeof(*pem));
+        pem->aux_size = _HF_PERF_AUX_SZ;
+        aux = (uint8_t*)malloc(_HF_PERF_AUX_SZ);
+    }
+
+    uint64_t total_bytes = 0;
+    uint64_t total_branches = 0;
+    std::chrono::duration<double> total_time(0);
+
+    for(int i = optind + 1; i < argc; i ++) {
+        pt_trace_header_t header;
+        uint8_t* trace = pt_trace_read(argv[i], &header);
+        if(trace == nullptr) {
+            exit(-1);
+        }
+        if(code.empty()) {
+            min_address = header.min_address;
+            max_address = header.max_address;
+            if(!read_raw_bin(raw_bin, max_address - min_address, code)) {
+                std::cerr << "read raw binary failed." << std::endl;
+                exit(-1);
+            }
+            auto start = std::chrono::steady_clock::now();
+            if(lazy) {
+                if(!cofi_map.init_lazy(code.data(), min_address, max_address)) {
+                    std::cerr << "set up lazy disassembly failed." << std::endl;
+                    exit(-1);
+                }
+                std::chrono::duration<double> map_time = std::chrono::steady_clock::now() - start;
+                std::cout << "lazy cofi map, set up in " << map_time.count() * 1000 << " ms" << std::endl;
+            }
+            else {
+                uint32_t num_cofi_inst = cache_dir ? disassemble_binary_cached(code.data(), min_address, max_address, cofi_map, cache_dir) :
+                        disassemble_binary(code.data(), min_address, max_address, cofi_map);
+                std::chrono::duration<double> map_time = std::chrono::steady_clock::now() - start;
+                std::cout << "number of cofi inst: " << num_cofi_inst << ", basic blocks: " << cofi_map.num_blocks() << ", "
+                          << (cofi_map.is_mapped() ? "mapped" : "built") << " in " << map_time.count() * 1000 << " ms" << std::endl;
+            }
+            if(use_run_cache) {
+                //one cache for all traces and iterations, like a fuzzing session.
+                run_cache = new tnt_run_cache(cofi_map, min_address, max_address, ret_compression);
+            }
+        }
+        else if(header.min_address != min_address || header.max_address != max_address) {
+            std::cerr << argv[i] << " was captured for a different binary range, skipped." << std::endl;
+            free(trace);
+            continue;
+        }
+
+        uint64_t num_decoded_branch = 0;
+        std::vector<uint8_t> trace_bits(MAP_SIZE);
+        std::chrono::duration<double> diff(0);
+        for(uint32_t n = 0; n < iterations; n ++) {
+            auto start = std::chrono::steady_clock::now();
+            pt_packet_decoder decoder(trace, header.trace_size, cofi_map, min_address, max_address, header.entry_point, run_cache);
+            decoder.set_ret_compression(ret_compression);
+            if(mid_trace) {
+                decoder.start_mid_trace();
+            }
+            if(chunk_size == 0) {
+                decoder.decode();
+            }
+            else {
+                for(uint64_t offset = 0; offset < header.trace_size; offset += chunk_size) {
+                    decoder.decode_chunk(trace + offset, std::min(chunk_size, header.trace_size - offset));
+                }
+            }
+            diff += std::chrono::steady_clock::now() - start;
+            num_decoded_branch = decoder.num_decoded_branch;
+            memcpy(trace_bits.data(), decoder.get_trace_bits(), MAP_SIZE);
+        }
+
+        std::cout << argv[i] << ": " << header.trace_size << " bytes, " << num_decoded_branch << " branches, "
+                  << diff.count() / iterations * 1000000 << " us/decode" << std::endl;
+        if(lazy) {
+            std::cout << argv[i] << ": " << cofi_map.size() << " cofi inst disassembled so far" << std::endl;
+        }
+
+        if(num_threads > 0) {
+            pt_parallel_decoder parallel(cofi_map, min_address, max_address, header.entry_point, num_threads, use_run_cache, ret_compression);
+            std::chrono::duration<double> parallel_diff(0);
+            for(uint32_t n = 0; n < iterations; n ++) {
+                auto start = std::chrono::steady_clock::now();
+                parallel.decode(trace, header.trace_size, mid_trace);
+                parallel_diff += std::chrono::steady_clock::now() - start;
+            }
+            if(parallel.num_decoded_branch != num_decoded_branch || memcmp(parallel.get_trace_bits(), trace_bits.data(), MAP_SIZE) != 0) {
+                std::cerr << argv[i] << ": the parallel decoder gave a different bitmap." << std::endl;
+                exit(1);
+            }
+            std::cout << argv[i] << ": " << num_threads << " threads, " << parallel.num_segments << " segments, " << parallel.num_redecoded
+                      << " decoded again, " << parallel_diff.count() / iterations * 1000000 << " us/decode" << std::endl;
+        }
+
+        if(decode_thread != nullptr) {
+            std::chrono::duration<double> drain(0);
+            for(uint32_t n = 0; n < iterations; n ++) {
+                pem->aux_head = 0;
+                pem->aux_tail = 0;
+                pt_packet_decoder decoder((uint8_t*)pem, aux, cofi_map, min_address, max_address, header.entry_point, run_cache);
+                decoder.set_ret_compression(ret_compression);
+                if(mid_trace) {
+                    decoder.start_mid_trace();
+                }
+                drain += replay_growing(decode_thread, &decoder, pem, aux, trace, header.trace_size, rate, _HF_PERF_AUX_SZ / 4);
+                if(decoder.num_decoded_branch != num_decoded_branch || memcmp(decoder.get_trace_bits(), trace_bits.data(), MAP_SIZE) != 0) {
+                    std::cerr << argv[i] << ": decoding the growing ring gave a different bitmap." << std::endl;
+                    exit(1);
+                }
+            }
+            std::cout << argv[i] << ": decoder thread, " << drain.count() / iterations * 1000000 << " us/decode left after exit" << std::endl;
+        }
+        free(trace);
+        total_bytes += header.trace_size * iterations;
+        total_branches += num_decoded_branch * iterations;
+        total_time += diff;
+    }
+
+    if(total_time.count() > 0) {
+        std::cout << "throughput: " << total_bytes / total_time.count() / (1024 * 1024) << " MB/s, "
+                  << total_branches / total_time.count() << " branches/s" << std::endl;
+    }
+    if(run_cache) {
+        std::cout << "TNT run cache: " << run_cache->size() << " runs, " << run_cache->num_hits << " hits, "
+                  << run_cache->num_misses << " misses" << std::endl;
+        delete run_cache;
+    }
+    if(decode_thread != nullptr) {
+        delete decode_thread;
+        free(pem);
+        free(aux);
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "pt_scan.h"
+#include <string.h>
+#include <stdlib.h>
+#include <iostream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PT_SCAN_X86 1
+#endif
+
+#define PSB_LEN 16
+
+static const uint8_t psb_pattern[PSB_LEN] = {
+	0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82,
+	0x02, 0x82, 0x02, 0x82, 0x02, 0x82, 0x02, 0x82
+};
+
+static uint8_t* find_psb_scalar(uint8_t* p, uint8_t* end) {
+	return (uint8_t*)memmem(p, end - p, psb_pattern, PSB_LEN);
+}
+
+static uint8_t* skip_pad_scalar(uint8_t* p, uint8_t* end) {
+	while(p < end && *p == 0) {
+		p ++;
+	}
+	return p;
+}
+
+#ifdef PT_SCAN_X86
+/* A PSB is 02 82 repeated eight times, so whatever its alignment it covers one
+   whole 8 byte word (counted from where the scan starts) that reads 02 82 .. or
+   82 02 ... Only those words are compared, and only around a hit the bytes are
+   checked one by one. */
+#define PSB_WORD_EVEN	0x8202820282028202ULL
+#define PSB_WORD_ODD	0x0282028202820282ULL
+
+//a PSB covering the word at q starts in the 8 bytes up to q.
+static uint8_t* psb_around(uint8_t* first, uint8_t* q, uint8_t* end) {
+	for(uint8_t* s = q - first >= 7 ? q - 7 : first; s <= q && end - s >= PSB_LEN; s ++) {
+		if(memcmp(s, psb_pattern, PSB_LEN) == 0) {
+			return s;
+		}
+	}
+	return nullptr;
+}
+
+__attribute__((target("sse4.2")))
+static uint8_t* find_psb_sse42(uint8_t* p, uint8_t* end) {
+	const __m128i even = _mm_set1_epi64x(PSB_WORD_EVEN);
+	const __m128i odd = _mm_set1_epi64x(PSB_WORD_ODD);
+	uint8_t* q = p;
+	while(end - q >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)q);
+		uint32_t mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_or_si128(_mm_cmpeq_epi64(v, even), _mm_cmpeq_epi64(v, odd))));
+		while(mask) {
+			uint8_t* psb_pos = psb_around(p, q + 8 * __builtin_ctz(mask), end);
+			if(psb_pos) {
+				return psb_pos;
+			}
+			mask &= mask - 1;
+		}
+		q += 16;
+	}
+	//whatever is left starts after q - 8.
+	return find_psb_scalar(q - p >= 7 ? q - 7 : p, end);
+}
+
+static uint8_t* skip_pad_sse2(uint8_t* p, uint8_t* end) {
+	const __m128i zero = _mm_setzero_si128();
+	while(end - p >= 16) {
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), zero));
+		if(mask != 0xffff) {
+			return p + __builtin_ctz(~mask);
+		}
+		p += 16;
+	}
+	return skip_pad_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static uint8_t* find_psb_avx2(uint8_t* p, uint8_t* end) {
+	const __m256i even = _mm256_set1_epi64x(PSB_WORD_EVEN);
+	const __m256i odd = _mm256_set1_epi64x(PSB_WORD_ODD);
+	uint8_t* q = p;
+	while(end - q >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)q);
+		uint32_t mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_cmpeq_epi64(v, even), _mm256_cmpeq_epi64(v, odd))));
+		while(mask) {
+			uint8_t* psb_pos = psb_around(p, q + 8 * __builtin_ctz(mask), end);
+			if(psb_pos) {
+				return psb_pos;
+			}
+			mask &= mask - 1;
+		}
+		q += 32;
+	}
+	return find_psb_scalar(q - p >= 7 ? q - 7 : p, end);
+}
+
+__attribute__((target("avx2")))
+static uint8_t* skip_pad_avx2(uint8_t* p, uint8_t* end) {
+	const __m256i zero = _mm256_setzero_si256();
+	while(end - p >= 32) {
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), zero));
+		if(mask != 0xffffffff) {
+			return p + __builtin_ctz(~mask);
+		}
+		p += 32;
+	}
+	return skip_pad_sse2(p, end);
+}
+#endif
+
+static const pt_scan_impl_t scan_scalar = {"scalar", find_psb_scalar, skip_pad_scalar};
+#ifdef PT_SCAN_X86
+static const pt_scan_impl_t scan_sse42 = {"sse4.2", find_psb_sse42, skip_pad_sse2};
+static const pt_scan_impl_t scan_avx2 = {"avx2", find_psb_avx2, skip_pad_avx2};
+#endif
+
+std::vector<const pt_scan_impl_t*> pt_scan_available() {
+	std::vector<const pt_scan_impl_t*> impls;
+#ifdef PT_SCAN_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		impls.push_back(&scan_avx2);
+	}
+	if(__builtin_cpu_supports("sse4.2")) {
+		impls.push_back(&scan_sse42);
+	}
+#endif
+	impls.push_back(&scan_scalar);
+	return impls;
+}
+
+static const pt_scan_impl_t* select_scan() {
+	std::vector<const pt_scan_impl_t*> impls = pt_scan_available();
+	char* name = getenv("AFL_PT_SCAN");
+	if(name != nullptr) {
+		for(auto impl : impls) {
+			if(strcmp(impl->name, name) == 0) {
+				return impl;
+			}
+		}
+		std::cerr << "AFL_PT_SCAN=" << name << " is not available, using " << impls[0]->name << "." << std::endl;
+	}
+	return impls[0];
+}
+
+static const pt_scan_impl_t* selected_scan = select_scan();
+pt_find_psb_fn pt_find_psb = selected_scan->find_psb;
+pt_skip_pad_fn pt_skip_pad = selected_scan->skip_pad;
+
+void pt_scan_use(const pt_scan_impl_t* impl) {
+	pt_find_psb = impl->find_psb;
+	pt_skip_pad = impl->skip_pad;
+}
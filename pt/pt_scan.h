@@ -0,0 +1,31 @@
+#ifndef _PT_SCAN_H_
+#define _PT_SCAN_H_
+
+#include <stdint.h>
+#include <vector>
+
+/* Byte scans the packet decoder spends its time in when the trace is sparse:
+   looking for the next PSB while out of sync, and stepping over runs of PAD
+   (zero) bytes. Each comes in a scalar, an SSE4.2 and an AVX2 version. The
+   best one the cpu supports is picked at startup; AFL_PT_SCAN=scalar|sse4.2|avx2
+   forces one, e.g. to compare them. */
+
+//first byte at or after p that starts a full PSB before end, nullptr if none.
+typedef uint8_t* (*pt_find_psb_fn)(uint8_t* p, uint8_t* end);
+//first non-zero byte at or after p, end if there is none.
+typedef uint8_t* (*pt_skip_pad_fn)(uint8_t* p, uint8_t* end);
+
+typedef struct {
+	const char* name;
+	pt_find_psb_fn find_psb;
+	pt_skip_pad_fn skip_pad;
+} pt_scan_impl_t;
+
+extern pt_find_psb_fn pt_find_psb;
+extern pt_skip_pad_fn pt_skip_pad;
+
+//implementations this cpu can run, best first.
+std::vector<const pt_scan_impl_t*> pt_scan_available();
+void pt_scan_use(const pt_scan_impl_t* impl);
+
+#endif
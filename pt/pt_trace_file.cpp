@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <iostream>
+#include "pt_trace_file.h"
+
+bool pt_trace_write(const char* path, pt_trace_header_t* header, const uint8_t* aux, uint64_t aux_size) {
+	uint64_t size = header->aux_head - header->aux_tail;
+	if(header->aux_head < header->aux_tail) {
+		size = 0;
+	}
+	//older data has been overwritten by the ring, keep the newest aux_size bytes.
+	uint64_t tail = header->aux_tail;
+	if(size > aux_size) {
+		tail = header->aux_head - aux_size;
+		size = aux_size;
+	}
+	header->magic = PT_TRACE_MAGIC;
+	header->version = PT_TRACE_VERSION;
+	header->header_size = sizeof(pt_trace_header_t);
+	header->trace_size = size;
+
+	FILE* fp = fopen(path, "wb");
+	if(fp == nullptr) {
+		std::cerr << "open trace file " << path << " for writing failed." << std::endl;
+		return false;
+	}
+	bool ok = fwrite(header, sizeof(pt_trace_header_t), 1, fp) == 1;
+	uint64_t offset = tail % aux_size;
+	uint64_t first = size < aux_size - offset ? size : aux_size - offset;
+	if(ok && first) {
+		ok = fwrite(aux + offset, first, 1, fp) == 1;
+	}
+	if(ok && size > first) {
+		ok = fwrite(aux, size - first, 1, fp) == 1;
+	}
+	fclose(fp);
+	return ok;
+}
+
+uint8_t* pt_trace_read(const char* path, pt_trace_header_t* header) {
+	FILE* fp = fopen(path, "rb");
+	if(fp == nullptr) {
+		std::cerr << "open trace file " << path << " failed." << std::endl;
+		return nullptr;
+	}
+	if(fread(header, sizeof(pt_trace_header_t), 1, fp) != 1 ||
+			header->magic != PT_TRACE_MAGIC || header->version != PT_TRACE_VERSION ||
+			header->header_size < sizeof(pt_trace_header_t)) {
+		std::cerr << path << " is not a PT trace file." << std::endl;
+		fclose(fp);
+		return nullptr;
+	}
+	//the header may grow, but the trace has to follow it inside the file.
+	struct stat st;
+	if(fstat(fileno(fp), &st) != 0 ||
+			header->header_size > (uint64_t)st.st_size || header->trace_size > (uint64_t)st.st_size - header->header_size) {
+		std::cerr << "trace file " << path << " is truncated." << std::endl;
+		fclose(fp);
+		return nullptr;
+	}
+	if(fseek(fp, header->header_size, SEEK_SET) != 0) {
+		std::cerr << "seek in trace file " << path << " failed." << std::endl;
+		fclose(fp);
+		return nullptr;
+	}
+	//one extra byte so an empty trace still gets a valid buffer.
+	uint8_t* trace = (uint8_t*)malloc(header->trace_size + 1);
+	if(trace == nullptr) {
+		std::cerr << "no memory for the " << header->trace_size << " byte trace in " << path << "." << std::endl;
+	} else if(header->trace_size && fread(trace, header->trace_size, 1, fp) != 1) {
+		std::cerr << "trace file " << path << " is truncated." << std::endl;
+		free(trace);
+		trace = nullptr;
+	}
+	fclose(fp);
+	return trace;
+}
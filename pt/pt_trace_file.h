@@ -0,0 +1,30 @@
+#ifndef _PT_TRACE_FILE_H_
+#define _PT_TRACE_FILE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* On-disk format of a captured PT trace: a fixed header followed by the raw
+   aux bytes between aux_tail and aux_head, already unwrapped from the ring. */
+
+#define PT_TRACE_MAGIC		0x0045434152545450ULL	/* "PTTRACE\0" */
+#define PT_TRACE_VERSION	1
+
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t aux_head;
+	uint64_t aux_tail;
+	uint64_t min_address;
+	uint64_t max_address;
+	uint64_t entry_point;
+	uint64_t trace_size;
+} pt_trace_header_t;
+
+//write aux[tail, head) of a ring buffer of aux_size bytes to path.
+bool pt_trace_write(const char* path, pt_trace_header_t* header, const uint8_t* aux, uint64_t aux_size);
+//read a captured trace, returns a malloc'd buffer of header->trace_size bytes or nullptr.
+uint8_t* pt_trace_read(const char* path, pt_trace_header_t* header);
+
+#endif
@@ -0,0 +1,365 @@
+#include "pt_trace_gen.h"
+
+//why a walk stopped, tells which packets have to follow it.
+enum {
+	WALK_TIP,		//indirect branch or return, continue with TIP
+	WALK_FAR,		//far transfer or unknown target, continue with TIP.PGD + TIP.PGE
+	WALK_STALL,		//stopped at a conditional branch, continue with FUP + TIP.PGD + TIP.PGE
+	WALK_END,		//path exhausted
+};
+
+//a jmp chain longer than this is taken for a loop the decoder would never leave.
+#define MAX_JMP_CHAIN	64
+
+pt_trace_generator::pt_trace_generator(const cofi_map_t& map, uint64_t min_address, uint64_t max_address, uint64_t entry_point, uint64_t seed) :
+		cofi_map(map), min_address(min_address), max_address(max_address), app_entry_point(entry_point), rng(seed) {
+	this->trace_bits = (uint8_t*)malloc(MAP_SIZE);
+	memset(this->trace_bits, 0, MAP_SIZE);
+	usable_cofi.resize(cofi_map.size());
+	for(uint32_t i = 0; i < cofi_map.size(); i ++) {
+		usable_cofi[i] = chain_ok(cofi_map.begin() + i);
+	}
+	uint64_t base_address = cofi_map.get_base_address();
+	for(uint64_t addr = base_address; addr < base_address + cofi_map.get_code_size(); addr ++) {
+		const cofi_inst_t* cofi = cofi_map[addr];
+		if(cofi != nullptr && !out_of_bounds(addr) && usable(cofi)) {
+			start_points.push_back(addr);
+		}
+	}
+}
+
+pt_trace_generator::~pt_trace_generator() {
+	free(this->trace_bits);
+}
+
+bool pt_trace_generator::chain_ok(const cofi_inst_t* cofi) {
+	//the decoder follows direct jumps without consuming anything, make sure that ends.
+	for(int i = 0; i < MAX_JMP_CHAIN; i ++) {
+		if(cofi == nullptr || cofi->type != COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH) {
+			return true;
+		}
+		cofi = cofi_map[cofi->target_addr];
+	}
+	return false;
+}
+
+bool pt_trace_generator::random_walk(uint64_t trace_size) {
+	this->path = nullptr;
+	const cofi_inst_t* entry = cofi_map[app_entry_point];
+	if(start_points.empty() || entry == nullptr || !usable(entry)) {
+		std::cerr << "can not start a walk at entry point 0x" << std::hex << app_entry_point << std::endl;
+		return false;
+	}
+	return generate(trace_size);
+}
+
+bool pt_trace_generator::follow_path(const std::vector<uint64_t>& path) {
+	if(path.empty() || path[0] != app_entry_point) {
+		std::cerr << "path has to start at entry point 0x" << std::hex << app_entry_point << std::endl;
+		return false;
+	}
+	this->path = &path;
+	this->path_pos = 1;
+	this->path_error = false;
+	bool ret = generate(UINT64_MAX);
+	this->path = nullptr;
+	return ret && !path_error;
+}
+
+bool pt_trace_generator::generate(uint64_t trace_size) {
+	trace.clear();
+	if(trace_size != UINT64_MAX) {
+		trace.reserve(trace_size + 64);
+	}
+	memset(this->trace_bits, 0, MAP_SIZE);
+	this->bitmap_last_ip = 0;
+	this->num_decoded_branch = 0;
+	this->tnt_count = 0;
+	this->tnt_limit = 0;
+	this->ret_stack.clear();
+
+	emit_psb(0);
+	uint64_t ip = app_entry_point;
+	trace.push_back(PT_PKT_MODE_BYTE0);
+	trace.push_back(1);
+	emit_ip(PT_PKT_TIP_PGE_BYTE0, ip);
+
+	bool resume = false;
+	while(true) {
+		uint64_t stop_ip = 0;
+		int reason = walk(ip, resume, &stop_ip);
+		if(reason == WALK_END || trace.size() >= trace_size) {
+			break;
+		}
+		if(reason == WALK_STALL && stall_resume) {
+			ip = stop_ip;
+		}
+		else {
+			ip = pick_start();
+			if(ip == 0) {
+				break;
+			}
+		}
+
+		flush_tnt();
+		bool overflow = !path && overflow_rate && rng() % overflow_rate == 0;
+		if(overflow) {
+			//the packets up to the next walk were lost, the decoder drops its walk and last ip.
+			trace.push_back(PT_PKT_OVF_BYTE0);
+			trace.push_back(PT_PKT_OVF_BYTE1);
+			this->last_ip = 0;
+			this->ret_stack.clear();
+			emit_ip(PT_PKT_TIP_FUP_BYTE0, ip);
+		}
+		else switch(reason) {
+		case WALK_TIP:
+			emit_ip(PT_PKT_TIP_BYTE0, ip);
+			break;
+		case WALK_STALL:
+			//the FUP is where the decoder's walk waits, it keeps waiting through TIP.PGD.
+			emit_ip(PT_PKT_TIP_FUP_BYTE0, stop_ip);
+			//fall through
+		case WALK_FAR:
+			trace.push_back(PT_PKT_TIP_PGD_BYTE0);
+			emit_pad();
+			trace.push_back(PT_PKT_MODE_BYTE0);
+			trace.push_back(1);
+			emit_ip(PT_PKT_TIP_PGE_BYTE0, ip);
+			break;
+		}
+		//TIP.PGE back to the same cofi picks the walk up without an edge.
+		resume = !overflow && reason == WALK_STALL && cofi_map[ip] == cofi_map[stop_ip];
+		emit_pad();
+		//PSB ends the decoder's walk and the FUP starts a new one, only put it where a walk starts.
+		if(trace.size() - last_psb >= psb_period) {
+			emit_psb(ip);
+			resume = false;
+		}
+	}
+
+	//TIP.PGD lets the decoder walk the last segment.
+	flush_tnt();
+	trace.push_back(PT_PKT_TIP_PGD_BYTE0);
+	return true;
+}
+
+int pt_trace_generator::walk(uint64_t start, bool resume, uint64_t* stop_ip) {
+	//mirrors pt_packet_decoder::decode_tnt(), deciding TNT bits instead of consuming them.
+	int reason = WALK_FAR;
+	const cofi_inst_t* cofi = cofi_map[start];
+	if(!resume) {
+		alter_bitmap(start);
+	}
+	while(cofi != nullptr) {
+		switch(cofi->type) {
+		case COFI_TYPE_CONDITIONAL_BRANCH: {
+			bool can_take = !out_of_bounds(cofi->target_addr) && usable(cofi_map[cofi->target_addr]);
+			bool can_fall = usable(cofi_map.next(cofi));
+			int choice = pick_branch(cofi, can_take, can_fall);
+			if(choice < 0) {
+				*stop_ip = cofi->inst_addr;
+				return choice == -1 ? WALK_STALL : WALK_END;
+			}
+			append_tnt(choice);
+			if(choice) {
+				alter_bitmap(cofi->target_addr);
+				cofi = cofi_map[cofi->target_addr];
+			}
+			else {
+				cofi = cofi_map.next(cofi);
+				alter_bitmap(cofi->inst_addr);
+			}
+			break;
+		}
+		case COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH:
+			push_ret(cofi);
+			alter_bitmap(cofi->target_addr);
+			if(path && path_pos < path->size() && (*path)[path_pos] == cofi->target_addr) {
+				path_pos ++;
+			}
+			cofi = cofi_map[cofi->target_addr];
+			break;
+		case COFI_TYPE_NEAR_RET: {
+			uint64_t ret_addr = pop_ret();
+			if(ret_addr != 0) {
+				append_tnt(true);
+				alter_bitmap(ret_addr);
+				if(path) {
+					path_pos ++;
+				}
+				cofi = cofi_map[ret_addr];
+				break;
+			}
+			reason = WALK_TIP;
+			cofi = nullptr;
+			break;
+		}
+		case COFI_TYPE_INDIRECT_BRANCH:
+			push_ret(cofi);
+			reason = WALK_TIP;
+			cofi = nullptr;
+			break;
+		default:
+			reason = WALK_FAR;
+			cofi = nullptr;
+			break;
+		}
+		this->num_decoded_branch ++;
+	}
+	return reason;
+}
+
+int pt_trace_generator::pick_branch(const cofi_inst_t* cofi, bool can_take, bool can_fall) {
+	//1 taken, 0 not taken, -1 stall here, -2 end of path.
+	if(path) {
+		if(path_pos >= path->size()) {
+			return -2;
+		}
+		uint64_t next = (*path)[path_pos];
+		if(can_take && next == cofi->target_addr) {
+			path_pos ++;
+			return 1;
+		}
+		if(can_fall && next == cofi_map.next(cofi)->inst_addr) {
+			path_pos ++;
+			return 0;
+		}
+		std::cerr << "path leaves the branch at 0x" << std::hex << cofi->inst_addr << " to 0x" << next << std::endl;
+		path_error = true;
+		return -2;
+	}
+	if(!can_take && !can_fall) {
+		stall_resume = false;
+		return -1;
+	}
+	if(interrupt_rate && rng() % interrupt_rate == 0) {
+		stall_resume = true;
+		return -1;
+	}
+	if(can_take && can_fall) {
+		return rng() & 1;
+	}
+	return can_take ? 1 : 0;
+}
+
+void pt_trace_generator::push_ret(const cofi_inst_t* call) {
+	if(!ret_compression || !call->is_call) {
+		return;
+	}
+	if(ret_stack.size() == PT_RET_STACK_SIZE) {
+		ret_stack.erase(ret_stack.begin());
+	}
+	ret_stack.push_back(call->inst_addr + call->inst_size);
+}
+
+//where a compressed return goes, 0 if this one has to end in a TIP.
+uint64_t pt_trace_generator::pop_ret() {
+	if(ret_stack.empty()) {
+		return 0;
+	}
+	uint64_t ret_addr = ret_stack.back();
+	if(out_of_bounds(ret_addr) || cofi_map[ret_addr] == nullptr || !usable(cofi_map[ret_addr])) {
+		return 0;
+	}
+	if(path && (path_pos >= path->size() || (*path)[path_pos] != ret_addr)) {
+		return 0;
+	}
+	//random walks leave some returns uncompressed, like a return to somewhere else would be.
+	if(!path && rng() % 8 == 0) {
+		return 0;
+	}
+	ret_stack.pop_back();
+	return ret_addr;
+}
+
+uint64_t pt_trace_generator::pick_start() {
+	if(path) {
+		if(path_pos >= path->size()) {
+			return 0;
+		}
+		uint64_t ip = (*path)[path_pos++];
+		if(out_of_bounds(ip) || cofi_map[ip] == nullptr || !usable(cofi_map[ip])) {
+			std::cerr << "path can not continue at 0x" << std::hex << ip << std::endl;
+			path_error = true;
+			return 0;
+		}
+		return ip;
+	}
+	return start_points[rng() % start_points.size()];
+}
+
+void pt_trace_generator::emit_psb(uint64_t fup_ip) {
+	for(int i = 0; i < PT_PKT_PSB_LEN / 2; i ++) {
+		trace.push_back(PT_PKT_PSB_BYTE0);
+		trace.push_back(PT_PKT_PSB_BYTE1);
+	}
+	this->last_ip = 0;
+	this->last_psb = trace.size();
+	this->ret_stack.clear();
+	//MODE.Exec, 64-bit code.
+	trace.push_back(PT_PKT_MODE_BYTE0);
+	trace.push_back(1);
+	if(fup_ip) {
+		emit_ip(PT_PKT_TIP_FUP_BYTE0, fup_ip);
+	}
+	trace.push_back(PT_PKT_PSBEND_BYTE0);
+	trace.push_back(PT_PKT_PSBEND_BYTE1);
+}
+
+void pt_trace_generator::emit_ip(uint8_t opcode, uint64_t ip) {
+	//use any IP compression the decoder's last ip allows.
+	int len = 3;
+	uint64_t r = rng() % 3;
+	if(r == 0 && (ip >> 16) == (last_ip >> 16)) {
+		len = 1;
+	}
+	else if(r <= 1 && (ip >> 32) == (last_ip >> 32)) {
+		len = 2;
+	}
+	trace.push_back(opcode | (len << PT_PKT_TIP_SHIFT));
+	for(int i = 0; i < len; i ++) {
+		trace.push_back((uint8_t)(ip >> (16 * i)));
+		trace.push_back((uint8_t)(ip >> (16 * i + 8)));
+	}
+	this->last_ip = ip;
+}
+
+void pt_trace_generator::emit_pad() {
+	if(rng() % 32 == 0) {
+		trace.insert(trace.end(), 1 + rng() % 8, 0);
+	}
+}
+
+void pt_trace_generator::append_tnt(bool taken) {
+	if(tnt_limit == 0) {
+		//mostly short TNT, one in four packets is a long TNT.
+		tnt_limit = rng() % 4 ? 1 + rng() % SHORT_TNT_MAX_BITS : 1 + rng() % (LONG_TNT_MAX_BITS);
+	}
+	tnt_bits = (tnt_bits << 1) | taken;
+	tnt_count ++;
+	if(tnt_count == tnt_limit) {
+		flush_tnt();
+	}
+}
+
+void pt_trace_generator::flush_tnt() {
+	//oldest branch in the highest bit, right below the stop bit.
+	if(tnt_count == 0) {
+		return;
+	}
+	uint64_t payload = (1ULL << tnt_count) | tnt_bits;
+	if(tnt_count <= SHORT_TNT_MAX_BITS) {
+		trace.push_back((uint8_t)(payload << 1));
+	}
+	else {
+		trace.push_back(PT_PKT_LTNT_BYTE0);
+		trace.push_back(PT_PKT_LTNT_BYTE1);
+		for(int i = 0; i < 6; i ++) {
+			trace.push_back((uint8_t)(payload >> (8 * i)));
+		}
+	}
+	tnt_bits = 0;
+	tnt_count = 0;
+	tnt_limit = 0;
+	emit_pad();
+}
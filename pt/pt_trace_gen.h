@@ -0,0 +1,104 @@
+#ifndef _PT_TRACE_GEN_H_
+#define _PT_TRACE_GEN_H_
+
+#include <random>
+#include <vector>
+#include "pt.h"
+
+/* Synthesize Intel PT packet streams from a cofi map, without PT hardware.
+   The generator walks the control flow graph (randomly, or along a given
+   path), emits the packets the CPU would have written for that walk and
+   computes the edge bitmap pt_packet_decoder must rebuild from them.
+
+   The walk mirrors pt_packet_decoder::decode_tnt() step by step: every
+   conditional branch gets a TNT bit, indirect branches and returns end in a
+   TIP, far transfers in TIP.PGD/TIP.PGE, and now and then an "interrupt"
+   leaves through FUP + TIP.PGD. Between two walks the cpu may also lose
+   packets, which leaves an OVF and a FUP with the IP it resumes at. PSB+
+   (PSB, MODE, FUP, PSBEND) is inserted every psb_period bytes, PAD bytes are
+   sprinkled between packets, and TNT bits are packed into short or long TNT
+   packets at random. The same seed always gives the same trace.
+
+   With ret_compression a return to the instruction after its call is a
+   taken TNT bit instead of a TIP whenever the walk can go on there, the
+   way the decoder's shadow stack expects it. */
+
+class pt_trace_generator {
+	const cofi_map_t& cofi_map;
+	uint64_t min_address;
+	uint64_t max_address;
+	uint64_t app_entry_point;
+	std::mt19937_64 rng;
+	//per cofi record: false if a jmp loop follows it, the walk must not get there.
+	std::vector<bool> usable_cofi;
+	//instructions a TIP may land on.
+	std::vector<uint64_t> start_points;
+
+	std::vector<uint8_t> trace;
+	uint64_t last_ip = 0;
+	uint64_t last_psb = 0;
+	uint64_t tnt_bits = 0;
+	uint32_t tnt_count = 0;
+	uint32_t tnt_limit = 0;
+
+	const std::vector<uint64_t>* path = nullptr;
+	size_t path_pos = 0;
+	bool path_error = false;
+	bool stall_resume = false;
+
+	uint64_t bitmap_last_ip = 0;
+	uint8_t* trace_bits;
+
+	//return addresses of the calls walked since the last PSB, at most PT_RET_STACK_SIZE.
+	std::vector<uint64_t> ret_stack;
+public:
+	//bytes between two PSB+ sequences, the hardware default is in the same range.
+	uint64_t psb_period = 4096;
+	//one in interrupt_rate conditional branches is interrupted, 0 disables interrupts.
+	uint32_t interrupt_rate = 1024;
+	//one in overflow_rate walks ends in OVF + FUP instead of its usual packets, 0 disables overflows.
+	uint32_t overflow_rate = 256;
+	//compress returns, see above.
+	bool ret_compression = false;
+	//branches the decoder is expected to count for the generated trace.
+	uint64_t num_decoded_branch = 0;
+public:
+	pt_trace_generator(const cofi_map_t& map, uint64_t min_address, uint64_t max_address, uint64_t entry_point, uint64_t seed);
+	~pt_trace_generator();
+	//random walk from the entry point until the trace is at least trace_size bytes.
+	bool random_walk(uint64_t trace_size);
+	//walk along path, the addresses the decoder reports edges to. path[0] must be the entry point.
+	bool follow_path(const std::vector<uint64_t>& path);
+	std::vector<uint8_t>& get_trace() { return trace; }
+	uint8_t* get_trace_bits() { return trace_bits; }
+private:
+	bool generate(uint64_t trace_size);
+	//resume: go on where the last walk stalled, no edge to start.
+	int walk(uint64_t start, bool resume, uint64_t* stop_ip);
+	int pick_branch(const cofi_inst_t* cofi, bool can_take, bool can_fall);
+	void push_ret(const cofi_inst_t* call);
+	uint64_t pop_ret();
+	uint64_t pick_start();
+	bool chain_ok(const cofi_inst_t* cofi);
+	inline bool usable(const cofi_inst_t* cofi) {
+		return cofi == nullptr || usable_cofi[cofi - cofi_map.begin()];
+	}
+
+	void emit_psb(uint64_t fup_ip);
+	void emit_ip(uint8_t opcode, uint64_t ip);
+	void emit_pad();
+	void append_tnt(bool taken);
+	void flush_tnt();
+
+	inline bool out_of_bounds(uint64_t addr) {
+		return addr < this->min_address || addr > this->max_address;
+	}
+	//same as pt_packet_decoder::alter_bitmap().
+	inline void alter_bitmap(uint64_t addr) {
+		uint16_t pos16 = (uint16_t)bitmap_last_ip ^ (uint16_t)addr;
+		trace_bits[pos16]++;
+		bitmap_last_ip = addr >> 1;
+	}
+};
+
+#endif
@@ -73,15 +73,15 @@ int main (int argc, char** argv) {
 	cofi_map_t cofi_map;
 	uint32_t num_cofi_inst = disassemble_binary(raw_bin_buf, min_addr_cle, max_addr_cle, cofi_map);
 	uint64_t addr_start = min_addr_cle;
-	cofi_inst_t* head = cofi_map[addr_start];
-	while(head == nullptr) {
+	const cofi_inst_t* head = cofi_map[addr_start];
+	while(head == nullptr && addr_start < max_addr_cle) {
 		addr_start ++;
 		head = cofi_map[addr_start];
 	}
 	std::cout << "first address contain cofi is : " << addr_start << std::endl;
-	while(head != nullptr) {
+	while(head != nullptr && head->type != NO_COFI_TYPE) {
 		std::cout << std::hex << head->inst_addr << " -> " << head->target_addr << std::endl;
-		head = head->next_cofi;
+		head = cofi_map.next(head);
 	}
 	std::cout << "number of cofi inst: " << num_cofi_inst << std::endl;
 	return 0;
@@ -21,74 +21,27 @@ along with QEMU-PT.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "tnt_cache.h"
 
-#define BIT(x)				(1ULL << (x))
-#define NOT_TAKEN			0
-#define TAKEN				1
-#define TNT_EMPTY			2
-
-#define SHORT_TNT_OFFSET	1
-#define SHORT_TNT_MAX_BITS	8-1-SHORT_TNT_OFFSET
-
-#define LONG_TNT_OFFSET		16
-#define LONG_TNT_MAX_BITS	64-1-LONG_TNT_OFFSET
-
 static inline uint8_t asm_bsr(uint64_t x){
 	__asm__("bsrq %0, %0" : "=r" (x) : "0" (x));
 	return x;
 }
 
-static void free_tnt_cache(tnt_cache_t* self){
-	tnt_cache_obj* tmp;
-	tnt_cache_obj* new_tnt;
-	if(self->head){
-		new_tnt = self->head;
-		tmp = NULL;
-		while(new_tnt){
-			tmp = new_tnt;
-			new_tnt = new_tnt->next;
-			free(tmp);
-		}
-		self->head = NULL;
-		self->next_node = NULL;
+/* Append the bits of one TNT payload, bits are in stream order, the oldest
+   in the highest position. */
+static inline void push_tnt_bits(tnt_cache_t* self, uint64_t bits, uint8_t count){
+	if (self->tail - self->head + count > TNT_CACHE_BITS){
+		self->dropped += count;
+		return;
 	}
-}
-
-static inline void free_tnt_cache_obj(tnt_cache_t* self){
-	tnt_cache_obj* tmp;
-	tmp = self->head;
-	self->head = self->head->next;
-	free(tmp);
-}
-
-uint8_t process_tnt_cache(tnt_cache_t* self){
-	uint8_t ret;
-	if(self->head){
-		/* Short TNT */
-		if (self->head->bits <= SHORT_TNT_MAX_BITS){
-			ret = !!(self->head->data & BIT((SHORT_TNT_OFFSET-1) + self->head->bits - self->head->processed));
-		}
-		/* Long TNT */
-		else {
-			ret = !!(self->head->data & BIT((LONG_TNT_OFFSET-1) + (self->head->bits - self->head->processed)));
-		}
-			
-		self->counter--;
-		self->head->processed++;
-		
-		/* Free this TNT cache object if consumed... */
-		if (self->head->processed == self->head->bits){
-			if(self->next_node == self->head){
-				free_tnt_cache(self);
-			} 
-			else {
-				free_tnt_cache_obj(self);	
-			}
-		}
-		return ret;
-	} 
-	
-	/* TNT cache seems to be empty... */
-	return TNT_EMPTY;
+	uint32_t offset = self->tail & 63;
+	uint64_t* word = &self->ring[(self->tail >> 6) & TNT_CACHE_MASK];
+	uint64_t aligned = bits << (64 - count);
+	/* everything behind tail in a word is garbage from the last lap, overwrite it */
+	*word = (offset ? *word & (~0ULL << (64 - offset)) : 0) | (aligned >> offset);
+	if (offset + count > 64){
+		self->ring[((self->tail >> 6) + 1) & TNT_CACHE_MASK] = aligned << (64 - offset);
+	}
+	self->tail += count;
 }
 
 uint32_t count_tnt_bits(bool short_tnt, uint64_t data) {
@@ -99,67 +52,59 @@ uint32_t count_tnt_bits(bool short_tnt, uint64_t data) {
 	}
 	else{
 		/* Long TNT magic  */ 
-		bits = asm_bsr(data)-LONG_TNT_MAX_BITS;
+		data >>= LONG_TNT_OFFSET;
+		if (!data){
+			return 0;
+		}
+		bits = asm_bsr(data);
 	}
 	return bits;
 }
 
 void append_tnt_cache(tnt_cache_t* self, bool short_tnt, uint64_t data){
-	tnt_cache_obj* new_tnt;
 	uint8_t bits;
 
 	if(short_tnt){
-		/* Short TNT magic  */ 
+		/* Short TNT magic: stop bit, then the branches from bit 1 on */ 
+		data &= 0xff;
 		bits = asm_bsr(data)-SHORT_TNT_OFFSET;
+		data >>= SHORT_TNT_OFFSET;
 	}
 	else{
-		/* Long TNT magic  */ 
-		bits = asm_bsr(data)-LONG_TNT_MAX_BITS;
+		/* Long TNT magic: stop bit, then the branches from bit 0 of the payload on */ 
+		data >>= LONG_TNT_OFFSET;
+		if (!data){
+			return;
+		}
+		bits = asm_bsr(data);
 	}
 	
 	if (!bits){
 		/* trailing 1 not found... */
 		return;
 	}
-	
-	new_tnt = (tnt_cache_obj*)malloc(sizeof(tnt_cache_obj));
-	new_tnt->bits = bits;
-	if(self->next_node){
-		self->next_node->next = new_tnt;
-	}
-	else{
-		self->head = new_tnt;
-	}
-	new_tnt->processed = 0;
-	new_tnt->data = data;
-	new_tnt->next = NULL;
-	self->next_node = new_tnt;
-	self->counter += bits;
-}
-
-bool is_empty_tnt_cache(tnt_cache_t* self){
-	return (bool)!!(self->counter);
-}
 
-int count_tnt(tnt_cache_t* self){
-	return self->counter;
+	/* strip the stop bit */
+	push_tnt_bits(self, data & ((1ULL << bits) - 1), bits);
 }
 
 tnt_cache_t* tnt_cache_init(void){
 	tnt_cache_t* res = (tnt_cache_t*)malloc(sizeof(tnt_cache_t));
-	res->head = NULL;
-	res->next_node = NULL;
-	res->counter = 0;
+	res->ring = (uint64_t*)malloc(TNT_CACHE_BITS / 8);
+	res->head = 0;
+	res->tail = 0;
+	res->dropped = 0;
 	return res;
 }
 
 tnt_cache_t* tnt_cache_reset(tnt_cache_t* res){
-	tnt_cache_destroy(res);
-    return tnt_cache_init();
+	res->head = 0;
+	res->tail = 0;
+	res->dropped = 0;
+	return res;
 }
 
 void tnt_cache_destroy(tnt_cache_t* self){
-	free_tnt_cache(self);
+	free(self->ring);
 	free(self);
 }
-
@@ -32,32 +32,74 @@ along with QEMU-PT.  If not, see <http://www.gnu.org/licenses/>.
 #define TNT_EMPTY			2
 
 #define SHORT_TNT_OFFSET	1
-#define SHORT_TNT_MAX_BITS	8-1-SHORT_TNT_OFFSET
+#define SHORT_TNT_MAX_BITS	(8-1-SHORT_TNT_OFFSET)
 
 #define LONG_TNT_OFFSET		16
-#define LONG_TNT_MAX_BITS	64-1-LONG_TNT_OFFSET
+#define LONG_TNT_MAX_BITS	(64-1-LONG_TNT_OFFSET)
 
-typedef struct tnt_cache_obj{
-	uint8_t bits;
-	uint64_t data;
-	uint8_t processed;
-	struct tnt_cache_obj* next;
-}tnt_cache_obj;
+/* Pending TNT bits live in a ring of 64-bit words, in stream order from the
+   most significant bit down. head and tail are absolute bit positions that
+   only ever grow, tail - head is the number of pending bits. The ring is
+   allocated once in tnt_cache_init(); bits that do not fit are counted in
+   dropped and lost, the decoder then gives up its walk until the next PSB. */
+#define TNT_CACHE_BITS		(1ULL << 23)
+#define TNT_CACHE_MASK		(TNT_CACHE_BITS / 64 - 1)
 
 typedef struct tnt_cache_s{
-	tnt_cache_obj* head;
-	tnt_cache_obj* next_node;
-	uint8_t counter;
+	uint64_t* ring;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
 } tnt_cache_t;
 
 tnt_cache_t* tnt_cache_init(void);
 tnt_cache_t* tnt_cache_reset(tnt_cache_t* self);
 void tnt_cache_destroy(tnt_cache_t* self);
 
-bool is_empty_tnt_cache(tnt_cache_t* self);
-int count_tnt(tnt_cache_t* self);
-uint8_t process_tnt_cache(tnt_cache_t* self);
 void append_tnt_cache(tnt_cache_t* self, bool short_tnt, uint64_t data);
 uint32_t count_tnt_bits(bool short_tnt, uint64_t data);
 
+static inline bool is_empty_tnt_cache(tnt_cache_t* self){
+	return self->head == self->tail;
+}
+
+static inline uint64_t count_tnt(tnt_cache_t* self){
+	return self->tail - self->head;
+}
+
+static inline uint8_t process_tnt_cache(tnt_cache_t* self){
+	if (self->head == self->tail){
+		return TNT_EMPTY;
+	}
+	uint64_t word = self->ring[(self->head >> 6) & TNT_CACHE_MASK];
+	uint8_t ret = (word >> (63 - (self->head & 63))) & 1;
+	self->head++;
+	return ret;
+}
+
+/* Look at the next n (at most 57) bits without consuming them, fewer if the
+   cache runs dry. The oldest bit ends up in the highest position of *bits. */
+static inline uint32_t peek_tnt_cache(tnt_cache_t* self, uint32_t n, uint64_t* bits){
+	uint64_t count = self->tail - self->head;
+	if (count < n){
+		n = count;
+	}
+	if (!n){
+		*bits = 0;
+		return 0;
+	}
+	uint32_t offset = self->head & 63;
+	uint64_t word = self->ring[(self->head >> 6) & TNT_CACHE_MASK] << offset;
+	if (offset + n > 64){
+		word |= self->ring[((self->head >> 6) + 1) & TNT_CACHE_MASK] >> (64 - offset);
+	}
+	*bits = word >> (64 - n);
+	return n;
+}
+
+static inline void drop_tnt_cache(tnt_cache_t* self, uint32_t n){
+	uint64_t count = self->tail - self->head;
+	self->head += n < count ? n : count;
+}
+
 #endif 
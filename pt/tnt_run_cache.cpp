@@ -0,0 +1,87 @@
+#include "tnt_run_cache.h"
+
+//a run that follows more jumps than this is left to the slow path.
+#define TNT_RUN_MAX_STEPS	256
+
+tnt_run_cache::tnt_run_cache(const cofi_map_t& map, uint64_t min_address, uint64_t max_address, bool stop_at_calls) :
+		cofi_map(map), min_address(min_address), max_address(max_address), stop_at_calls(stop_at_calls) {
+	index = kh_init(TNT_RUN);
+}
+
+tnt_run_cache::~tnt_run_cache() {
+	kh_destroy(TNT_RUN, index);
+}
+
+const tnt_run_t* tnt_run_cache::fill(uint64_t key, const cofi_inst_t* cofi, uint32_t count, uint64_t bits) {
+	//same walk as pt_packet_decoder::decode_tnt(), with the bits known up front.
+	tnt_run_t run;
+	run.edge_offset = edges.size();
+	run.num_edges = 0;
+	run.num_branches = 0;
+	run.first_addr = 0;
+	run.last_ip = 0;
+
+	uint32_t consumed = 0;
+	uint32_t steps = 0;
+	bool first = true;
+	auto enter = [&](uint64_t addr) {
+		if(first) {
+			run.first_addr = (uint16_t)addr;
+			first = false;
+		}
+		else {
+			edges.push_back((uint16_t)run.last_ip ^ (uint16_t)addr);
+			run.num_edges ++;
+		}
+		run.last_ip = addr >> 1;
+	};
+
+	while(cofi != nullptr) {
+		if(steps ++ == TNT_RUN_MAX_STEPS) {
+			consumed = 0;
+			break;
+		}
+		if(cofi->type == COFI_TYPE_CONDITIONAL_BRANCH) {
+			if(consumed == count) {
+				break;
+			}
+			if((bits >> (count - 1 - consumed)) & 1) {
+				//the decoder reports out of bounds targets, let it do so.
+				if(cofi->target_addr < min_address || cofi->target_addr > max_address) {
+					break;
+				}
+				enter(cofi->target_addr);
+				cofi = cofi_map[cofi->target_addr];
+			}
+			else {
+				cofi = cofi_map.next(cofi);
+				enter(cofi->inst_addr);
+			}
+			consumed ++;
+		}
+		else if(cofi->type == COFI_TYPE_UNCONDITIONAL_DIRECT_BRANCH && !(stop_at_calls && cofi->is_call)) {
+			enter(cofi->target_addr);
+			cofi = cofi_map[cofi->target_addr];
+		}
+		else {
+			//decode_tnt() takes it from here, and counts it.
+			break;
+		}
+		run.num_branches ++;
+	}
+
+	run.next = cofi;
+	run.consumed = consumed;
+	if(consumed == 0) {
+		edges.resize(run.edge_offset);
+		run.num_edges = 0;
+		run.num_branches = 0;
+	}
+
+	int ret;
+	khiter_t k = kh_put(TNT_RUN, index, key, &ret);
+	kh_value(index, k) = runs.size();
+	runs.push_back(run);
+	num_misses ++;
+	return &runs.back();
+}
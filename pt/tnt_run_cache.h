@@ -0,0 +1,72 @@
+#ifndef _TNT_RUN_CACHE_H_
+#define _TNT_RUN_CACHE_H_
+
+#include <vector>
+#include "disassembler.h"
+#include "khash.h"
+
+/* Memoized decode_tnt() steps. Starting at a conditional branch with up to
+   TNT_RUN_MAX_BITS pending TNT bits, the walk is fully determined by the cofi
+   map: which blocks are entered, how many bits are consumed and how many
+   branches are counted. A run records exactly that, so a whole TNT8 worth of
+   branches is applied with one hash lookup. The only part that depends on the
+   decoder state is the first edge, which is xor'ed with the caller's last ip;
+   every other edge of the run is stored as a ready bitmap index.
+
+   A run ends at the first cofi it cannot follow (indirect branch, return,
+   far transfer) and leaves that one to the decoder. With stop_at_calls it
+   also ends at calls, whose return address the decoder has to push when the
+   trace has compressed returns.
+
+   Runs are filled in lazily on a miss and kept as long as the cache lives,
+   pt_fuzzer keeps one for the whole fuzzing session. The cofi map must not
+   change during that time. */
+
+#define TNT_RUN_MAX_BITS	8
+
+typedef struct {
+	const cofi_inst_t* next;	//cofi the run ends at, nullptr if the walk left the code
+	uint64_t last_ip;			//decoder's bitmap_last_ip after the run
+	uint32_t edge_offset;		//first of num_edges bitmap indices in tnt_run_cache::edges
+	uint16_t num_edges;
+	uint16_t first_addr;		//low 16 bits of the first address entered, its edge is computed by the caller
+	uint32_t num_branches;
+	uint8_t consumed;			//TNT bits used, 0 if this step has to go through the slow path
+} tnt_run_t;
+
+KHASH_MAP_INIT_INT64(TNT_RUN, uint32_t)
+
+class tnt_run_cache {
+	const cofi_map_t& cofi_map;
+	uint64_t min_address;
+	uint64_t max_address;
+	bool stop_at_calls;
+	khash_t(TNT_RUN)* index;
+	std::vector<tnt_run_t> runs;
+	std::vector<uint16_t> edges;
+public:
+	uint64_t num_hits = 0;
+	uint64_t num_misses = 0;
+public:
+	tnt_run_cache(const cofi_map_t& map, uint64_t min_address, uint64_t max_address, bool stop_at_calls = false);
+	~tnt_run_cache();
+	/* run for the conditional branch cofi and the next count TNT bits, oldest
+	   bit highest. The pointer is valid until the next lookup. */
+	inline const tnt_run_t* lookup(const cofi_inst_t* cofi, uint32_t count, uint64_t bits) {
+		uint64_t key = ((uint64_t)(cofi - cofi_map.begin()) << (TNT_RUN_MAX_BITS + 1)) | (1ULL << count) | bits;
+		khiter_t k = kh_get(TNT_RUN, index, key);
+		if(k != kh_end(index)) {
+			num_hits ++;
+			return &runs[kh_value(index, k)];
+		}
+		return fill(key, cofi, count, bits);
+	}
+	inline const uint16_t* get_edges(const tnt_run_t* run) const {
+		return edges.data() + run->edge_offset;
+	}
+	size_t size() const { return runs.size(); }
+private:
+	const tnt_run_t* fill(uint64_t key, const cofi_inst_t* cofi, uint32_t count, uint64_t bits);
+};
+
+#endif